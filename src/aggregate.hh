@@ -0,0 +1,170 @@
+#ifndef AGGREGATE_HH
+#define AGGREGATE_HH
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+
+#include "vec2.hh"
+#include "flock.hh"
+#include "grid.hh"
+#include "pool.hh"
+
+/**
+ * Running totals of the agents in each cell of a uniform grid, for the mean position and
+ * velocity of every agent within a radius, in the spirit of Barnes-Hut: cells whose agents
+ * all lie within the radius add their totals at once, only the cells the edge of the radius
+ * crosses are scanned agent by agent. The cost grows with the radius over the cell size
+ * instead of with the number of agents in range, which keeps large cohesion and alignment
+ * radii affordable in dense flocks. The totals are summed in double precision, so results
+ * differ from summing neighbor by neighbor only by rounding.
+ */
+struct aggregate_grid {
+    struct totals {
+        unsigned count = 0;
+        double px = 0, py = 0; // sum of positions
+        double vx = 0, vy = 0; // sum of velocities
+
+        void add(float x, float y, float vx, float vy, int sign = 1)
+        {
+            count += sign;
+            px += sign * x; py += sign * y;
+            this->vx += sign * vx; this->vy += sign * vy;
+        }
+        void add(const totals& t)
+        {
+            count += t.count;
+            px += t.px; py += t.py;
+            vx += t.vx; vy += t.vy;
+        }
+        vec2f mean_pos() const { return { float(px / count), float(py / count) }; }
+        vec2f mean_vel() const { return { float(vx / count), float(vy / count) }; }
+    };
+
+    struct cell {
+        totals sum;
+        float x0, y0, x1, y1; // bounds of the agents in the cell, which can stray outside it at the edges of the grid
+    };
+
+    spatial_grid grid;
+    std::vector<cell> cells;
+    std::vector<float> x, y, vx, vy; // of the items, in grid order
+    std::vector<unsigned> slot;        // position of each agent in grid order, or -1 if left out
+
+    // how far the last check() found the means off from summing agent by agent
+    float position_error = 0, velocity_error = 0;
+    unsigned samples = 0;
+
+    /**
+     * rebuild the totals over the agents accepted by include, on a grid of cell_size cells covering width by height.
+     * the agents are gridded in one go like the neighbor grids, the cells are then totalled in parallel
+     */
+    template <typename Agent, typename Pred>
+    void build(thread_pool& pool, const flock<Agent>& agents, float cell_size, float width, float height, Pred include)
+    {
+        if (grid.cell_size != std::max(cell_size, 1.f) || grid.cols == 0) grid.resize(cell_size, width, height);
+        grid.build(agents.size(), [&](std::size_t i) { return agents.pos(i); }, include);
+
+        const std::size_t count = grid.items.size();
+        x.resize(count); y.resize(count);
+        vx.resize(count); vy.resize(count);
+        slot.assign(agents.size(), -1);
+        cells.resize(grid.cols * grid.rows);
+        pool.parallel_for(cells.size(), [&](std::size_t begin, std::size_t end) {
+            for (std::size_t c = begin; c < end; c++) {
+                cell& cl = cells[c];
+                cl = { {}, INFINITY, INFINITY, -INFINITY, -INFINITY };
+                for (unsigned k = grid.start[c]; k < grid.start[c + 1]; k++) {
+                    const unsigned i = grid.items[k];
+                    x[k] = agents.x[i]; y[k] = agents.y[i];
+                    vx[k] = agents.vx[i]; vy[k] = agents.vy[i];
+                    slot[i] = k;
+                    cl.sum.add(x[k], y[k], vx[k], vy[k]);
+                    cl.x0 = std::min(cl.x0, x[k]); cl.x1 = std::max(cl.x1, x[k]);
+                    cl.y0 = std::min(cl.y0, y[k]); cl.y1 = std::max(cl.y1, y[k]);
+                }
+            }
+        }, 64);
+    }
+
+    /** @return the totals of the agents within radius of p, leaving out agent skip */
+    totals sum(const vec2f& p, float radius, unsigned skip) const
+    {
+        totals t;
+        const float r2 = radius * radius;
+        const int c0 = grid.col_of(p.x - radius), c1 = grid.col_of(p.x + radius);
+        const int r0 = grid.row_of(p.y - radius), r1 = grid.row_of(p.y + radius);
+        for (int r = r0; r <= r1; r++) {
+            for (int c = c0; c <= c1; c++) {
+                const cell& cl = cells[r * grid.cols + c];
+                if (!cl.sum.count) continue;
+
+                // nearest and farthest points of the bounds
+                const float nx = std::max({ cl.x0 - p.x, p.x - cl.x1, 0.f }), ny = std::max({ cl.y0 - p.y, p.y - cl.y1, 0.f });
+                if (nx * nx + ny * ny > r2) continue;
+                const float fx = std::max(std::abs(p.x - cl.x0), std::abs(p.x - cl.x1)), fy = std::max(std::abs(p.y - cl.y0), std::abs(p.y - cl.y1));
+                if (fx * fx + fy * fy <= r2) {
+                    t.add(cl.sum);
+                    continue;
+                }
+                scan(r * grid.cols + c, p, r2, t);
+            }
+        }
+        remove(skip, p, r2, t);
+        return t;
+    }
+
+    /** @return the same as sum(), adding up every agent in range one by one */
+    totals exact(const vec2f& p, float radius, unsigned skip) const
+    {
+        totals t;
+        const float r2 = radius * radius;
+        const int c0 = grid.col_of(p.x - radius), c1 = grid.col_of(p.x + radius);
+        const int r0 = grid.row_of(p.y - radius), r1 = grid.row_of(p.y + radius);
+        for (int r = r0; r <= r1; r++) {
+            for (int c = c0; c <= c1; c++) scan(r * grid.cols + c, p, r2, t);
+        }
+        remove(skip, p, r2, t);
+        return t;
+    }
+
+    /**
+     * compare sum() against exact() for every stride-th agent in the grid, recording the largest
+     * difference in mean position and mean velocity within radius
+     */
+    void check(float radius, std::size_t stride)
+    {
+        position_error = velocity_error = 0;
+        samples = 0;
+        for (std::size_t k = 0; k < grid.items.size(); k += stride) {
+            const vec2f p{ x[k], y[k] };
+            const totals a = sum(p, radius, grid.items[k]), e = exact(p, radius, grid.items[k]);
+            samples++;
+            if (a.count != e.count) { // the sets differ, not just the rounding
+                position_error = velocity_error = INFINITY;
+                continue;
+            }
+            if (!e.count) continue;
+            position_error = std::max(position_error, mag(a.mean_pos() - e.mean_pos()));
+            velocity_error = std::max(velocity_error, mag(a.mean_vel() - e.mean_vel()));
+        }
+    }
+
+    void scan(std::size_t c, const vec2f& p, float r2, totals& t) const
+    {
+        for (unsigned k = grid.start[c]; k < grid.start[c + 1]; k++) {
+            if (dist_squared(p, { x[k], y[k] }) <= r2) t.add(x[k], y[k], vx[k], vy[k]);
+        }
+    }
+
+    /** take agent i back out of t, if it was counted */
+    void remove(unsigned i, const vec2f& p, float r2, totals& t) const
+    {
+        if (i >= slot.size() || slot[i] == unsigned(-1)) return;
+        const unsigned k = slot[i];
+        if (dist_squared(p, { x[k], y[k] }) <= r2) t.add(x[k], y[k], vx[k], vy[k], -1);
+    }
+};
+
+#endif
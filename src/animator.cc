@@ -336,10 +336,18 @@ void tick() {
 }
 
 
+#if SDL_VERSION_ATLEAST(2, 0, 18)
+line_batch lines; // every line of a frame, drawn in one call at the end of Render
+
+void drawline(SDL_Renderer*, vertex v1, vertex v2) {
+	lines.add({ v1.pos.x, v1.pos.y }, { v1.col.x, v1.col.y, v1.col.z, SDL_ALPHA_OPAQUE },
+	          { v2.pos.x, v2.pos.y }, { v2.col.x, v2.col.y, v2.col.z, SDL_ALPHA_OPAQUE });
+}
+#else
 void drawline(SDL_Renderer* sdlRenderer, vertex v1, vertex v2) {
 
 	// std::cout << "drawing line " << v1.pos << " to " << v2.pos << std::endl;
-	// TODO: update SDL so this can use RenderGeometry
+	// no RenderGeometry before SDL 2.0.18, so fade the color point by point
 	float dt = 1 / std::max(std::abs(v2.pos.x - v1.pos.x), std::abs(v2.pos.y - v1.pos.y));
 	vertex v = v1;
 	for (float t = 0; t < 1; t += dt) {
@@ -350,6 +358,7 @@ void drawline(SDL_Renderer* sdlRenderer, vertex v1, vertex v2) {
 
 
 }
+#endif
 
 
 void Render(SDL_Renderer* sdlRenderer) {
@@ -392,6 +401,10 @@ void Render(SDL_Renderer* sdlRenderer) {
 
 	}
 
+	#if SDL_VERSION_ATLEAST(2, 0, 18)
+	lines.draw(sdlRenderer);
+	#endif
+
 }
 
 
@@ -2,7 +2,7 @@
 #define CLEANUP_HH
 
 #include <utility>
-#include <SDL2\SDL.h>
+#include <SDL2/SDL.h>
 
 /**
  * Disposes of each argument with the appropriate destroy or free function
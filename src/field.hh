@@ -0,0 +1,144 @@
+#ifndef FIELD_HH
+#define FIELD_HH
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+#include "vec2.hh"
+#include "util.hh"
+
+/**
+ * Signed distance to the nearest solid area, sampled on a regular grid of cell by cell pixel
+ * squares, positive outside and negative inside, together with its normalized gradient.
+ * It is built once from a solid / open test, after that the distance and direction to the
+ * nearest surface anywhere cost one bilinear lookup however complex the solid areas are.
+ */
+struct distance_field {
+    float cell = 0;                // pixels between samples
+    unsigned cols = 0, rows = 0;
+    std::vector<float> dist;       // signed distance of each sample in pixels, row by row
+    std::vector<float> gx, gy;     // unit gradient of each sample, pointing away from the nearest surface
+
+    bool empty() const { return dist.empty(); }
+
+    void clear()
+    {
+        cols = rows = 0;
+        dist.clear();
+        gx.clear();
+        gy.clear();
+    }
+
+    /**
+     * Sample cols by rows cells, solid(col, row) tells if the center of a cell is inside an obstacle.
+     * The field is left empty if no cell is solid
+     */
+    template <typename Solid>
+    void build(unsigned cols, unsigned rows, float cell, Solid solid)
+    {
+        clear();
+        const std::size_t n = std::size_t(cols) * rows;
+        std::vector<float> outside(n), inside(n); // squared distance in cells to the nearest solid / open cell
+        bool any = false;
+        for (unsigned r = 0; r < rows; r++) {
+            for (unsigned c = 0; c < cols; c++) {
+                const bool s = solid(c, r);
+                outside[r * cols + c] = s ? 0 : far;
+                inside[r * cols + c] = s ? far : 0;
+                any |= s;
+            }
+        }
+        if (!any) return;
+
+        this->cols = cols;
+        this->rows = rows;
+        this->cell = cell;
+        transform(outside, cols, rows);
+        transform(inside, cols, rows);
+
+        // the surface lies half a cell from the center of the cells on either side of it
+        dist.resize(n);
+        for (std::size_t k = 0; k < n; k++) {
+            dist[k] = outside[k] > 0 ? (std::sqrt(outside[k]) - .5f) * cell : -(std::sqrt(inside[k]) - .5f) * cell;
+        }
+
+        gx.resize(n);
+        gy.resize(n);
+        for (unsigned r = 0; r < rows; r++) {
+            for (unsigned c = 0; c < cols; c++) {
+                const unsigned c0 = c ? c - 1 : c, c1 = std::min(c + 1, cols - 1);
+                const unsigned r0 = r ? r - 1 : r, r1 = std::min(r + 1, rows - 1);
+                const vec2f g = normal(vec2f{ dist[r * cols + c1] - dist[r * cols + c0], dist[r1 * cols + c] - dist[r0 * cols + c] });
+                gx[r * cols + c] = g.x;
+                gy[r * cols + c] = g.y;
+            }
+        }
+    }
+
+    /** @return the shortest vector from pos to the nearest solid area, zero inside one. the field must not be empty */
+    vec2f to_surface(const vec2f& pos) const
+    {
+        // bilinear weights between the four samples around pos, clamped to the edge samples outside the field
+        const float fx = clamp(pos.x / cell - .5f, 0.f, cols - 1.f);
+        const float fy = clamp(pos.y / cell - .5f, 0.f, rows - 1.f);
+        const unsigned c0 = fx, r0 = fy;
+        const unsigned c1 = std::min(c0 + 1, cols - 1), r1 = std::min(r0 + 1, rows - 1);
+        const float tx = fx - c0, ty = fy - r0;
+        auto lerp = [&](const std::vector<float>& v) {
+            const float top = v[r0 * cols + c0] * (1 - tx) + v[r0 * cols + c1] * tx;
+            const float bottom = v[r1 * cols + c0] * (1 - tx) + v[r1 * cols + c1] * tx;
+            return top * (1 - ty) + bottom * ty;
+        };
+        return -normal(vec2f{ lerp(gx), lerp(gy) }) * std::max(lerp(dist), 0.f);
+    }
+
+    static constexpr float far = 1e20f;
+
+    /** replace the squared distances in f with the squared euclidean distance transform of f, one axis at a time */
+    static void transform(std::vector<float>& f, unsigned cols, unsigned rows)
+    {
+        const unsigned n = std::max(cols, rows);
+        std::vector<float> in(n), out(n), z(n + 1);
+        std::vector<unsigned> v(n);
+        for (unsigned c = 0; c < cols; c++) {
+            for (unsigned r = 0; r < rows; r++) in[r] = f[r * cols + c];
+            transform_1d(in.data(), out.data(), rows, v.data(), z.data());
+            for (unsigned r = 0; r < rows; r++) f[r * cols + c] = out[r];
+        }
+        for (unsigned r = 0; r < rows; r++) {
+            transform_1d(&f[r * cols], out.data(), cols, v.data(), z.data());
+            std::copy(out.begin(), out.begin() + cols, f.begin() + r * cols);
+        }
+    }
+
+    /** 1d squared distance transform of n samples, the lower envelope of the parabolas rooted at each f[q] */
+    static void transform_1d(const float* f, float* d, unsigned n, unsigned* v, float* z)
+    {
+        unsigned k = 0;
+        v[0] = 0;
+        z[0] = -INFINITY;
+        z[1] = INFINITY;
+        for (unsigned q = 1; q < n; q++) {
+            float s;
+            for (;;) {
+                const float p = v[k];
+                s = ((f[q] + float(q) * q) - (f[v[k]] + p * p)) / (2 * (float(q) - p));
+                if (s > z[k]) break;
+                k--; // z[0] is -inf, so this stops at the first parabola
+            }
+            k++;
+            v[k] = q;
+            z[k] = s;
+            z[k + 1] = INFINITY;
+        }
+        k = 0;
+        for (unsigned q = 0; q < n; q++) {
+            while (z[k + 1] < q) k++;
+            const float dq = float(q) - v[k];
+            d[q] = dq * dq + f[v[k]];
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,235 @@
+#ifndef FLOCK_HH
+#define FLOCK_HH
+
+#include <vector>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <SDL2/SDL.h>
+
+#include "vec2.hh"
+
+#define FLAG_LEADER 0b001
+#define FLAG_HANDED 0b010
+
+/**
+ * Structure of arrays storage for a population of agents.
+ * Each field lives in its own contiguous array so the neighbor loops only pull
+ * the fields they read into cache. Agent is the plain struct with the same
+ * fields (pos, vel, dir, flags, state, state_since, state_until, start_pos, start_vel, id), used to load and store
+ * one whole agent at a time.
+ */
+template <typename Agent>
+struct flock {
+    typedef decltype(Agent::state) state_type;
+
+    std::vector<float> x, y;   // position
+    std::vector<float> vx, vy; // velocity
+    std::vector<float> dx, dy; // unit direction
+    std::vector<unsigned> flags;
+    std::vector<state_type> state;
+    std::vector<uint64_t> state_since; // tick the current state was entered at
+    std::vector<uint64_t> state_until; // tick the current state times out at
+    std::vector<float> start_x, start_y;   // position the current state was entered with
+    std::vector<float> start_vx, start_vy; // velocity the current state was entered with
+    std::vector<unsigned> id; // stays with the agent when the flock is reordered
+
+    flock(std::size_t count = 0) { resize(count); }
+
+    std::size_t size() const { return x.size(); }
+
+    void resize(std::size_t count)
+    {
+        x.resize(count); y.resize(count);
+        vx.resize(count); vy.resize(count);
+        dx.resize(count); dy.resize(count);
+        flags.resize(count);
+        state.resize(count);
+        state_since.resize(count);
+        state_until.resize(count);
+        start_x.resize(count); start_y.resize(count);
+        start_vx.resize(count); start_vy.resize(count);
+        id.resize(count);
+    }
+
+    vec2f pos(std::size_t i) const { return { x[i], y[i] }; }
+    vec2f vel(std::size_t i) const { return { vx[i], vy[i] }; }
+    vec2f dir(std::size_t i) const { return { dx[i], dy[i] }; }
+
+    vec2f start_pos(std::size_t i) const { return { start_x[i], start_y[i] }; }
+    vec2f start_vel(std::size_t i) const { return { start_vx[i], start_vy[i] }; }
+
+    Agent load(std::size_t i) const { return { pos(i), vel(i), dir(i), flags[i], state[i], state_since[i], state_until[i], start_pos(i), start_vel(i), id[i] }; }
+
+    /** copy the fields neighbor queries read from the agents listed in order, so they sit contiguously in that order */
+    void gather(const flock& from, const std::vector<unsigned>& order)
+    {
+        resize(order.size());
+        for (std::size_t k = 0; k < order.size(); k++) {
+            unsigned i = order[k];
+            x[k] = from.x[i]; y[k] = from.y[i];
+            vx[k] = from.vx[i]; vy[k] = from.vy[i];
+            dx[k] = from.dx[i]; dy[k] = from.dy[i];
+            flags[k] = from.flags[i];
+        }
+    }
+
+    /** copy every field of the agents listed in order, so they end up stored in that order */
+    void permute(const flock& from, const std::vector<unsigned>& order)
+    {
+        gather(from, order);
+        for (std::size_t k = 0; k < order.size(); k++) {
+            unsigned i = order[k];
+            state[k] = from.state[i];
+            state_since[k] = from.state_since[i];
+            state_until[k] = from.state_until[i];
+            start_x[k] = from.start_x[i]; start_y[k] = from.start_y[i];
+            start_vx[k] = from.start_vx[i]; start_vy[k] = from.start_vy[i];
+            id[k] = from.id[i];
+        }
+    }
+
+    void store(std::size_t i, const Agent& a)
+    {
+        x[i] = a.pos.x; y[i] = a.pos.y;
+        vx[i] = a.vel.x; vy[i] = a.vel.y;
+        dx[i] = a.dir.x; dy[i] = a.dir.y;
+        flags[i] = a.flags;
+        state[i] = a.state;
+        state_since[i] = a.state_since;
+        state_until[i] = a.state_until;
+        start_x[i] = a.start_pos.x; start_y[i] = a.start_pos.y;
+        start_vx[i] = a.start_vel.x; start_vy[i] = a.start_vel.y;
+        id[i] = a.id;
+    }
+};
+
+/**
+ * Two flocks that swap roles every tick: a tick reads the current flock and
+ * writes every field of every agent into the next one, then swaps, so the
+ * population is never copied or reallocated. Between ticks, previous() holds
+ * the state from before the last tick, for renderers and recorders.
+ * Agents can be reordered in storage, index_of finds an agent by its id.
+ */
+template <typename Agent>
+struct flock_buffers {
+    flock<Agent> buffers[2];
+    unsigned front = 0;
+    std::vector<unsigned> slot; // index of each id, the same in both flocks
+
+    flock_buffers(std::size_t count = 0) { resize(count); }
+
+    std::size_t size() const { return buffers[front].size(); }
+
+    void resize(std::size_t count)
+    {
+        buffers[0].resize(count);
+        buffers[1].resize(count);
+    }
+
+    flock<Agent>& current() { return buffers[front]; }
+    const flock<Agent>& current() const { return buffers[front]; }
+    const flock<Agent>& previous() const { return buffers[front ^ 1]; }
+
+    /** the buffer the running tick writes into, it becomes current after swap() */
+    flock<Agent>& next() { return buffers[front ^ 1]; }
+    void swap() { front ^= 1; }
+
+    std::size_t index_of(unsigned id) const { return slot[id]; }
+
+    /** make previous match current, after the current flock was edited outside of a tick */
+    void sync()
+    {
+        buffers[front ^ 1] = buffers[front];
+        find_slots();
+    }
+
+    /**
+     * Store the agents in the given order of their current indices. previous() keeps
+     * the old order, so this must be followed by a tick before previous() is read
+     */
+    void reorder(const std::vector<unsigned>& order)
+    {
+        next().permute(current(), order);
+        swap();
+        find_slots();
+    }
+
+    void find_slots()
+    {
+        const flock<Agent>& agents = current();
+        slot.resize(agents.size());
+        for (std::size_t i = 0; i < agents.size(); i++) slot[agents.id[i]] = i;
+    }
+};
+
+/**
+ * The indices of the agents of a flock in each of its States states, so every state can be
+ * updated in a loop of its own with no per agent switch. The lists are built in storage
+ * order, which follows the agents' Z-order after a reorder. Steps record the agents that
+ * changed state, and only those are moved: an agent leaves a gone mark in its old list,
+ * so the others keep their order, and joins the end of its new one. A list is compacted,
+ * in order, once a quarter of it is marks. The lists hold indices, so they must be built
+ * again after the agents are reordered
+ */
+template <unsigned States>
+struct state_lists {
+    static constexpr unsigned gone = -1; // in place of an agent that left the list, loops skip it
+
+    std::vector<unsigned> members[States];
+    unsigned holes[States] = {};  // gone marks in each list
+    std::vector<unsigned> list;   // the list each agent is in
+    std::vector<unsigned> slot;   // where in it
+    std::vector<unsigned> moved;  // agents recorded since the last update, first moved_count of them
+    SDL_atomic_t moved_count;
+
+    template <typename Agent>
+    void build(const flock<Agent>& agents)
+    {
+        for (unsigned s = 0; s < States; s++) {
+            members[s].clear();
+            holes[s] = 0;
+        }
+        list.resize(agents.size());
+        slot.resize(agents.size());
+        moved.resize(agents.size());
+        SDL_AtomicSet(&moved_count, 0);
+        for (std::size_t i = 0; i < agents.size(); i++) add(i, agents.state[i]);
+    }
+
+    /** note that agent i changed state, safe to call from several threads at once */
+    void record(unsigned i) { moved[SDL_AtomicAdd(&moved_count, 1)] = i; }
+
+    /** move the agents recorded since the last update to the lists of their states now */
+    template <typename Agent>
+    void update(const flock<Agent>& agents)
+    {
+        const unsigned count = SDL_AtomicGet(&moved_count);
+        if (!count) return;
+        std::sort(moved.begin(), moved.begin() + count); // threads record in any order
+        for (unsigned m = 0; m < count; m++) {
+            const unsigned i = moved[m];
+            members[list[i]][slot[i]] = gone;
+            holes[list[i]]++;
+            add(i, agents.state[i]);
+        }
+        SDL_AtomicSet(&moved_count, 0);
+
+        for (unsigned s = 0; s < States; s++) {
+            if (holes[s] * 4 <= members[s].size()) continue;
+            std::vector<unsigned>& l = members[s];
+            l.erase(std::remove(l.begin(), l.end(), gone), l.end());
+            for (unsigned k = 0; k < l.size(); k++) slot[l[k]] = k;
+            holes[s] = 0;
+        }
+    }
+
+    void add(unsigned i, unsigned s)
+    {
+        list[i] = s;
+        slot[i] = members[s].size();
+        members[s].push_back(i);
+    }
+};
+
+#endif
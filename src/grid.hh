@@ -0,0 +1,92 @@
+#ifndef GRID_HH
+#define GRID_HH
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+
+#include "vec2.hh"
+#include "util.hh"
+
+/**
+ * Uniform grid used to find nearby agents without testing every pair.
+ * It is rebuilt from scratch with a counting sort whenever the agents move, so
+ * the items of each cell end up contiguous in items[start[c] .. start[c + 1]).
+ * Positions outside the grid are clamped into the border cells, which keeps
+ * queries correct for agents that have wandered off screen.
+ */
+struct spatial_grid {
+    float cell_size = 1;
+    int cols = 0, rows = 0;
+
+    std::vector<unsigned> start; // cols * rows + 1 offsets into items
+    std::vector<unsigned> items; // item indices, sorted by cell
+    std::vector<unsigned> cell;  // scratch, cell of each item (or -1 if excluded)
+    std::vector<unsigned> next;  // scratch, next free slot of each cell
+
+    int col_of(float x) const { return static_cast<int>(clamp(x / cell_size, 0.f, cols - 1.f)); }
+    int row_of(float y) const { return static_cast<int>(clamp(y / cell_size, 0.f, rows - 1.f)); }
+
+    /** set the cell size and the area covered by the grid, keeping at least one cell */
+    void resize(float size, float width, float height)
+    {
+        cell_size = size > 1 ? size : 1;
+        cols = std::max(1, static_cast<int>(std::ceil(width / cell_size)));
+        rows = std::max(1, static_cast<int>(std::ceil(height / cell_size)));
+        start.assign(cols * rows + 1, 0);
+    }
+
+    /**
+     * Bucket count items into their cells
+     * \param pos returns the position of the item at an index
+     * \param include returns false for items that should be left out of the grid
+     */
+    template <typename Pos, typename Pred>
+    void build(std::size_t count, Pos pos, Pred include)
+    {
+        const unsigned excluded = -1;
+        cell.resize(count);
+        std::fill(start.begin(), start.end(), 0);
+
+        for (std::size_t i = 0; i < count; i++) {
+            if (!include(i)) { cell[i] = excluded; continue; }
+            vec2f p = pos(i);
+            cell[i] = row_of(p.y) * cols + col_of(p.x);
+            start[cell[i] + 1]++;
+        }
+        for (std::size_t c = 1; c < start.size(); c++) start[c] += start[c - 1];
+
+        items.resize(start.back());
+        next.assign(start.begin(), start.end() - 1);
+        for (std::size_t i = 0; i < count; i++) {
+            if (cell[i] != excluded) items[next[cell[i]]++] = i;
+        }
+    }
+
+    /**
+     * call f(begin, end) for each run of items in the cells overlapping the square of half size radius around p.
+     * cells are stored row major, so each row of the square is one contiguous run of items
+     */
+    template <typename F>
+    void query_ranges(const vec2f& p, float radius, F f) const
+    {
+        int c0 = col_of(p.x - radius), c1 = col_of(p.x + radius);
+        int r0 = row_of(p.y - radius), r1 = row_of(p.y + radius);
+        for (int r = r0; r <= r1; r++) {
+            unsigned begin = start[r * cols + c0], end = start[r * cols + c1 + 1];
+            if (begin != end) f(begin, end);
+        }
+    }
+
+    /** call f(index) for every item in the cells overlapping the square of half size radius around p */
+    template <typename F>
+    void query(const vec2f& p, float radius, F f) const
+    {
+        query_ranges(p, radius, [&](unsigned begin, unsigned end) {
+            for (unsigned k = begin; k < end; k++) f(items[k]);
+        });
+    }
+};
+
+#endif
@@ -0,0 +1,161 @@
+#ifndef KDTREE_HH
+#define KDTREE_HH
+
+#include <vector>
+#include <algorithm>
+#include <cstddef>
+
+#include "vec2.hh"
+#include "pool.hh"
+
+/**
+ * 2d tree over a set of points, rebuilt every tick, for k nearest neighbor queries
+ * that cost O(k log n) however densely the points are packed.
+ * The tree is implicit: the root (node 1) covers every point, node n covering
+ * items[begin, end) splits it at the median of its wider axis, and its children
+ * 2n and 2n + 1 cover [begin, mid) and [mid, end). Ranges of leaf_size points or
+ * less are leaves.
+ */
+struct kd_tree {
+    static const unsigned leaf_size = 8;
+
+    std::vector<unsigned> items; // point indices, in tree order
+    std::vector<float> x, y;     // point positions, in tree order
+    std::vector<float> split;    // split coordinate of each node
+    std::vector<unsigned char> axis; // split axis of each node, 0 for x, 1 for y
+
+    struct subtree { unsigned node, begin, end; };
+    std::vector<subtree> subtrees; // scratch, built in parallel
+
+    /** rebuild the tree over count points, pos(i) returns the position of point i */
+    template <typename Pos>
+    void build(thread_pool& pool, std::size_t count, Pos pos)
+    {
+        items.resize(count);
+        x.resize(count);
+        y.resize(count);
+        for (std::size_t i = 0; i < count; i++) {
+            items[i] = i;
+            vec2f p = pos(i);
+            x[i] = p.x;
+            y[i] = p.y;
+        }
+        unsigned levels = 1;
+        for (std::size_t n = count; n > leaf_size; n = (n + 1) / 2) levels++;
+        split.resize(std::size_t(1) << levels);
+        axis.resize(std::size_t(1) << levels);
+
+        // split the top of the tree here, until there are enough subtrees to share between the threads
+        subtrees.clear();
+        subtrees.push_back({ 1, 0, static_cast<unsigned>(count) });
+        for (std::size_t level = 0; subtrees.size() < pool.size() * 4 && level < 16; level++) {
+            std::vector<subtree> children;
+            for (const subtree& t : subtrees) {
+                if (t.end - t.begin <= leaf_size) { children.push_back(t); continue; }
+                unsigned mid = split_node(t.node, t.begin, t.end);
+                children.push_back({ 2 * t.node, t.begin, mid });
+                children.push_back({ 2 * t.node + 1, mid, t.end });
+            }
+            if (children.size() == subtrees.size()) break; // only leaves left
+            subtrees.swap(children);
+        }
+        pool.parallel_for(subtrees.size(), [&](std::size_t begin, std::size_t end) {
+            for (std::size_t t = begin; t < end; t++) build_node(subtrees[t].node, subtrees[t].begin, subtrees[t].end);
+        }, 1);
+
+        // put the positions in tree order so queries read them contiguously
+        std::vector<float> tx(count), ty(count);
+        for (std::size_t k = 0; k < count; k++) {
+            tx[k] = x[items[k]];
+            ty[k] = y[items[k]];
+        }
+        x.swap(tx);
+        y.swap(ty);
+    }
+
+    /**
+     * Append the (at most) k nearest points within radius of p to found, nearest first,
+     * with their squared distances to dist2. Points for which skip(i) is true are left out
+     */
+    template <typename Skip>
+    void nearest(const vec2f& p, unsigned k, float radius, Skip skip, std::vector<unsigned>& found, std::vector<float>& dist2) const
+    {
+        if (items.empty() || k == 0) return;
+        const std::size_t first = found.size();
+        float bound = radius * radius;
+        search(1, 0, items.size(), p, k, skip, first, bound, found, dist2);
+    }
+
+    /** partition node's range at its median, @return the middle */
+    unsigned split_node(unsigned node, unsigned begin, unsigned end)
+    {
+        float x0 = x[items[begin]], x1 = x0, y0 = y[items[begin]], y1 = y0;
+        for (unsigned k = begin + 1; k < end; k++) {
+            x0 = std::min(x0, x[items[k]]); x1 = std::max(x1, x[items[k]]);
+            y0 = std::min(y0, y[items[k]]); y1 = std::max(y1, y[items[k]]);
+        }
+        const bool by_y = y1 - y0 > x1 - x0;
+        const std::vector<float>& c = by_y ? y : x;
+        const unsigned mid = begin + (end - begin) / 2;
+        std::nth_element(items.begin() + begin, items.begin() + mid, items.begin() + end, [&](unsigned a, unsigned b) {
+            return c[a] < c[b] || (c[a] == c[b] && a < b);
+        });
+        axis[node] = by_y;
+        split[node] = c[items[mid]];
+        return mid;
+    }
+
+    void build_node(unsigned node, unsigned begin, unsigned end)
+    {
+        if (end - begin <= leaf_size) return;
+        unsigned mid = split_node(node, begin, end);
+        build_node(2 * node, begin, mid);
+        build_node(2 * node + 1, mid, end);
+    }
+
+    template <typename Skip>
+    void search(unsigned node, unsigned begin, unsigned end, const vec2f& p, unsigned k, Skip skip,
+                std::size_t first, float& bound, std::vector<unsigned>& found, std::vector<float>& dist2) const
+    {
+        if (end - begin <= leaf_size) {
+            for (unsigned t = begin; t < end; t++) {
+                const float d2 = dist_squared(p, { x[t], y[t] });
+                if (d2 > bound || skip(items[t])) continue;
+
+                // insertion sort into the k best so far
+                std::size_t n = found.size() - first;
+                if (n == k) {
+                    if (d2 >= dist2.back()) continue;
+                    found.pop_back();
+                    dist2.pop_back();
+                    n--;
+                }
+                std::size_t at = first + n;
+                found.push_back(0);
+                dist2.push_back(0);
+                while (at > first && dist2[at - 1] > d2) {
+                    found[at] = found[at - 1];
+                    dist2[at] = dist2[at - 1];
+                    at--;
+                }
+                found[at] = items[t];
+                dist2[at] = d2;
+                if (n + 1 == k) bound = dist2.back();
+            }
+            return;
+        }
+
+        const unsigned mid = begin + (end - begin) / 2;
+        const float diff = (axis[node] ? p.y : p.x) - split[node];
+        // the near side first, it shrinks the bound the most
+        if (diff < 0) {
+            search(2 * node, begin, mid, p, k, skip, first, bound, found, dist2);
+            if (diff * diff <= bound) search(2 * node + 1, mid, end, p, k, skip, first, bound, found, dist2);
+        } else {
+            search(2 * node + 1, mid, end, p, k, skip, first, bound, found, dist2);
+            if (diff * diff <= bound) search(2 * node, begin, mid, p, k, skip, first, bound, found, dist2);
+        }
+    }
+};
+
+#endif
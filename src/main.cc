@@ -3,25 +3,80 @@
 	#include <emscripten/emscripten.h>
 #endif
 
-#include <SDL2\SDL.h>
+#include <SDL2/SDL.h>
 
+#include <algorithm>
+#include <array>
+#include <utility>
 #include <cmath>
 #include <iostream>
 #include <fstream>
 #include <sstream>
-#include <random>
 
 #include "cleanup.hh"
 #include "resource.hh"
 #include "vec2.hh"
 #include "util.hh"
 #include "render.hh"
+#include "grid.hh"
+#include "flock.hh"
+#include "simd.hh"
+#include "neighbors.hh"
+#include "pool.hh"
+#include "tasks.hh"
+#include "random.hh"
+#include "profile.hh"
+#include "sort.hh"
+#include "obstacles.hh"
+#include "aggregate.hh"
+#include "snapshot.hh"
 
 /* Define window size */
 const int WINDOW_WIDTH = 1920;
 const int WINDOW_HEIGHT = 1080;
 
 unsigned DEBUG_ENABLE = 0;
+bool debugAllAgents = false; // draw the force terms of every agent in the debug display, not just the followed one
+// what the debug display needs from the simulation thread, which owns these like the main thread owns DEBUG_ENABLE
+bool recordForces = false; // keep the force terms of every agent
+bool reportStats = false;  // publish the neighbor list stats and timings
+
+unsigned threadCount = 0; // 0 runs one thread per cpu
+thread_pool pool;
+
+uint64_t randomSeed = 0;
+uint64_t tickCount = 0; // ticks simulated since startup, part of every random draw
+uint64_t headlessTicks = 0; // run this many ticks without a window and exit, 0 opens the window
+
+/*
+ * frame profiler, the indented phases are also counted in the phase above them. the phases of
+ * one species follow each other, but overlap those of the other species.
+ * the simulation thread and its pool own the phases before PROFILE_FRAME, the main thread the rest
+ */
+enum profile_id {
+    PROFILE_TICK,
+    PROFILE_BOID_NEIGHBORS,
+    PROFILE_BOID_REORDER,
+    PROFILE_BOID_STEP,
+    PROFILE_BOID_FLAGS,
+    PROFILE_FISH_NEIGHBORS,
+    PROFILE_FISH_REORDER,
+    PROFILE_FISH_STEP,
+    PROFILE_FISH_FLAGS,
+    PROFILE_PUBLISH,
+    PROFILE_FRAME,
+    PROFILE_RENDER_BOIDS,
+    PROFILE_RENDER_FISH,
+    PROFILE_HUD,
+    PROFILE_PRESENT,
+    PROFILE_COUNT
+};
+profile_phase profile[PROFILE_COUNT] = { "tick", "  boid neighbors", "    reorder", "  boid step", "  boid flags", "  fish neighbors", "    reorder", "  fish step", "  fish flags", "publish",
+                                         "frame", "render boids", "render fish", "hud", "present" };
+
+/* the simulation advances in fixed ticks, independent of the display's refresh rate */
+const double tickSeconds = 1.0 / 60;
+const unsigned maxTicksBehind = 4; // after slow ticks, drop the time we can't catch up on instead of falling further behind
 const float debugVecMultiplier = 200;
 
 /* boid parameters */
@@ -38,6 +93,10 @@ float cohesionRadius = 100;
 float avoidanceRadius = 25;
 float flockRadius = 150; 
 float obstacleRadius = 200;
+float neighborSkin = 0; // extra radius of the verlet candidate lists, 0 searches the grid every tick
+float nearestCount = 0; // interact with only this many nearest neighbors, 0 interacts with every neighbor in range
+unsigned reorderInterval = 64; // ticks between sorting the agents in storage by position, 0 never sorts
+float aggregateCell = 0; // cell size of the per cell totals alignment and cohesion are summed from, 0 sums them neighbor by neighbor
 
 float alignmentWeight = 0.05f;
 float cohesionWeight = 0.005f;
@@ -56,6 +115,9 @@ const int fish_size = 10;
 float edgeObstacle = 60;
 float groundHeight = 400;
 float waterHeight = 300;
+unsigned obstacleVersion = 1; // bumped when edgeObstacle is adjusted, the only obstacle setting that changes while running, so the obstacles are only rebuilt then
+std::string mapFile; // bitmap of extra obstacles in res, stretched over the window
+obstacle_map obstacleMap;
 
 float gravity = 0.1f;
 
@@ -78,9 +140,6 @@ float gravity = 0.1f;
 #define COLOR_WATER    0, 160, 200 // WATER BLUE
 #define COLOR_FISH   255, 255,  10 // GOLDFISH ORANGE
 
-#define FLAG_LEADER 0b001
-#define FLAG_HANDED 0b010
-
 enum boid_state { 
     FLYING, 
     TUMBLE, 
@@ -94,191 +153,214 @@ enum fish_state {
     HOPPING,
 };
 
+/** a single boid, as loaded from or stored into a flock */
 struct boid { 
     vec2f pos, vel, dir; 
     unsigned flags;
     boid_state state;
-    unsigned state_timer;
+    uint64_t state_since, state_until;
+    vec2f start_pos, start_vel;
+    unsigned id;
 };
 
+/** a single fish, as loaded from or stored into a flock */
 struct fish {
     vec2f pos, vel, dir; 
     unsigned flags;
     fish_state state;
-    unsigned state_timer;
+    uint64_t state_since, state_until;
+    vec2f start_pos, start_vel;
+    unsigned id;
 };
 
-std::vector<boid> boids(100);
-std::vector<SDL_FRect> boid_obstacles;
+/**
+ * what each random number is drawn for, so every use gets an independent stream.
+ * each species draws from its own block, starting at the draws of its traits:
+ * boids use 0 - 7 and fish 8 - 16, a new species starts past those
+ */
+enum random_draw {
+    DRAW_INIT_X, DRAW_INIT_Y, DRAW_INIT_VX, DRAW_INIT_VY, DRAW_INIT_HANDED, DRAW_INIT_LEADER,
+    DRAW_FLIP_HANDED, DRAW_FLIP_LEADER, DRAW_HOP,
+};
+
+/*
+ * states time out at a tick rather than counting down, so waiting costs nothing per tick:
+ * an agent stores the tick its state lasts until, and checks it only when it decides what to do next
+ */
 
-std::vector<fish> fishes(100);
-std::vector<SDL_FRect> fish_obstacles;
+/** @return the tick that is ticks after the one being simulated */
+uint64_t ticks_from_now(unsigned ticks) { return tickCount + ticks; }
 
-std::default_random_engine generator;
-std::uniform_real_distribution<float> rand_percent(0, 1);
+/** @return true once the tick being simulated has reached until */
+bool timed_out(uint64_t until) { return tickCount >= until; }
 
-/** calculate the acceleration of the boid at index, based on neighboring boids */
-vec2f calc_boid_accel(const std::vector<boid>& boids, std::size_t index, SDL_Renderer* debug_render = nullptr)
+/**
+ * put an agent in state as of the tick being simulated. it remembers where it entered the state from,
+ * so states that follow a path known in advance can put the agent on it for any tick in one go
+ */
+template <typename Agent>
+void enter(Agent& n, decltype(Agent::state) state)
 {
-    const boid& b = boids[index];
+    n.state = state;
+    n.state_since = tickCount;
+    n.start_pos = n.pos;
+    n.start_vel = n.vel;
+}
 
-    vec2f alignment_vec{ 0, 0 }, cohesion_vec{ 0, 0 }, avoidance_vec{ 0, 0 }, flock_vec{ 0, 0 };
-    int alignment_count = 0, cohesion_count = 0, avoidance_count = 0, flock_count = 0;
-    
-    for (std::size_t k = 0; k < boids.size(); k++)
-    {
-        if (k == index) continue;
-        
-        const boid& g = boids[k];
- 
-        if (g.state != FLYING) continue;
-    
-        if (dist_squared(b.pos, g.pos) <= alignmentRadius * alignmentRadius) {
-            alignment_vec += g.vel - b.vel;
-            alignment_count++;
-        }
-        if (dist_squared(b.pos, g.pos) <= cohesionRadius * cohesionRadius) {
-            cohesion_vec += g.pos - b.pos;
-            cohesion_count++;
-        }
-        if (dist_squared(b.pos, g.pos) <= avoidanceRadius * avoidanceRadius) {
-            if ((b.flags & FLAG_LEADER) && !(g.flags & FLAG_LEADER)) { // let leaders pass to the front
-                avoidance_vec += normal(b.vel) * (avoidanceRadius - mag(b.pos - g.pos));
-            } else {
-                avoidance_vec += normal(b.pos - g.pos) * (avoidanceRadius - mag(b.pos - g.pos));
-            }
-            avoidance_count++;
-        }
-        if (dist_squared(b.pos, g.pos) <= flockRadius * flockRadius) { 
-
-            if (!(g.flags & FLAG_LEADER)) continue; // only flock on leaders
-            if (dot(b.dir, g.dir) < 0) continue; // ignore boids not traveling in the same direction
-
-            vec2f tail = -g.dir; // vec backwards from g
-            vec2f g_to_b = b.pos - g.pos;  // vec from g to b
-            vec2f rej;
-            if (dot(g_to_b, g.dir) > 0) { // fall behind leader
-                vec2f p = proj(g_to_b, tail);
-                rej = p;
-            } else { // attempt to make a triangular looking flock
-                float rot = flockAngle * (b.flags & FLAG_HANDED ? 1 : -1);
-                tail = rotate(tail, rot); // rotate tail vector in handedness of b
-                vec2f p = proj(g_to_b, tail);
-                rej = g_to_b - p; // rejection from tail vector to b
-            }
+/** @return a random float in [0, 1), the same for every run with the same seed, tick, agent id and draw */
+float rand_percent(unsigned id, unsigned draw) { return random_percent(randomSeed, tickCount, id, draw); }
 
-            float tmp = mag(rej) - .75 * flockRadius;
-            rej = normal(rej) * ((-1 / (.75 * flockRadius)) * tmp * tmp + (flockRadius * .75));
-            flock_vec += -rej; // move b towards tail vector
-            flock_count++;
+/** @return a random float in [min, max), the same for every run with the same seed, tick, agent id and draw */
+float rand_range(float min, float max, unsigned id, unsigned draw) { return random_range(min, max, randomSeed, tickCount, id, draw); }
 
-            if (debug_render != nullptr)
-            {
-                SDL_SetRenderDrawColor(debug_render, COLOR_LEADER, 255);
-                RenderVec(debug_render, g.pos, tail * flockRadius);
-            }
-        }
-    }
+/** an axis aligned area, from its top left to its bottom right corner */
+struct area {
+    vec2f min, max;
+};
 
-    if (alignment_count > 0) {
-        alignment_vec /= alignment_count; 
-        alignment_vec *= alignmentWeight;
-    }
-    if (cohesion_count > 0) {
-        cohesion_vec /= cohesion_count;
-        cohesion_vec *= cohesionWeight;            
-    }
-    if (avoidance_count > 0) {
-        avoidance_vec *= avoidanceWeight;    
-    }
-    if (flock_count > 0) {
-        flock_vec /= flock_count;
-        flock_vec *= flockWeight;
-    }
+/** the force terms behind one agent's acceleration in one tick, kept for the debug display */
+struct force_record {
+    bool recorded = false; // false for agents that weren't flocking
+    vec2f pos;             // where the agent was when the forces were found
+    vec2f alignment, cohesion, avoidance, flock, obstacle, drag, base, accel;
+    vec2f leader_pos, leader_tail; // the last leader the agent lined up behind and its tail, zero if none
+};
 
-    vec2f obstacle_vec{ 0, 0 };
-    
-    vec2f closest_vec{INFINITY, INFINITY};
-    for (const SDL_FRect& obstacle : boid_obstacles) {
-        vec2f ob = vec_to(b.pos, obstacle);
-        if (mag(ob) > obstacleRadius) continue; // skip if outside obstacle avoidance radius
-        if (dot(ob, b.vel) < 0) continue; // skip if not headed toward the obstacle
-        if (mag(ob) < mag(closest_vec)) closest_vec = ob;
-    }
-    if (mag(closest_vec) != INFINITY) {
-        obstacle_vec += -normal(closest_vec - proj(closest_vec, b.vel)) * (obstacleRadius - mag(closest_vec)); 
+/** one population of agents, and everything the simulation keeps about it between ticks */
+template <typename Traits>
+struct species {
+    typedef typename Traits::agent Agent;
+
+    flock_buffers<Agent> agents;
+    obstacle_world world;     // obstacles the agents steer around
+    unsigned obstacle_version = 0; // obstacleVersion the world was last built for
+    spatial_grid grid;
+    flock<Agent> cells;       // neighbor fields of the agents in grid, in grid order
+    neighbor_list neighbors;  // neighbors of each agent this tick, as positions in cells
+    verlet_list verlet;       // candidate neighbors of each agent, when neighborSkin is set
+    kd_tree tree;             // positions of cells, when nearestCount is set
+    aggregate_grid aggregate; // totals of the interacting agents, when aggregateCell is set
+    std::vector<force_record> forces; // of each agent in the last tick, by its index then, while the debug display shows them
+    radix_sorter sorter;              // scratch for reordering the agents
+    std::vector<uint32_t> sort_keys;
+    std::vector<unsigned> sort_order;
+    state_lists<Traits::states> states; // the agents in each state, as of the start of the tick
+
+    species(std::size_t count) : agents(count) {}
+};
+
+/**
+ * What sets a species apart, everything else runs through the same templates: its agent type,
+ * the state in which agents flock and are searched as neighbors, its block of random draws,
+ * its profile phases, obstacles, spawn area and looks, and what agents do in each state.
+ * step<State>(agent, accel) advances an agent in State by one tick, calling accel() for the
+ * flocking acceleration while it is interacting. decorate() draws extras over an agent, as of a tick.
+ */
+struct boid_traits {
+    typedef boid agent;
+    static constexpr boid_state interacting = FLYING;
+    static constexpr unsigned states = 4;
+    static constexpr float friction = 0.2f;     // share of its speed a tumbling boid loses every tick
+    static constexpr float stop_speed = 0.5f;   // a tumbling boid stops once it's slower
+    static constexpr unsigned max_tumble = 120; // ticks a boid tumbles for at most
+    static constexpr unsigned draws = 0;
+    static constexpr const char* name = "boids";
+    static constexpr profile_id neighbors_phase = PROFILE_BOID_NEIGHBORS, reorder_phase = PROFILE_BOID_REORDER, step_phase = PROFILE_BOID_STEP, flags_phase = PROFILE_BOID_FLAGS;
+    static constexpr float size = boid_size;
+    static constexpr SDL_Color color = { COLOR_BOID, 255 };
+    static constexpr int debug_row = 13; // text row of the followed agent's details in the debug display, -1 for none
+
+    static area spawn() { return { { edgeObstacle, edgeObstacle }, { WINDOW_WIDTH - edgeObstacle, WINDOW_HEIGHT - groundHeight } }; }
+
+    static std::vector<SDL_FRect> obstacles()
+    {
+        return {
+            { 0, edgeObstacle, edgeObstacle, WINDOW_HEIGHT - edgeObstacle - groundHeight }, // left edge
+            { edgeObstacle, 0, WINDOW_WIDTH - 2 * edgeObstacle, edgeObstacle },  // top edge
+            { edgeObstacle, WINDOW_HEIGHT - groundHeight, WINDOW_WIDTH - 2 * edgeObstacle, edgeObstacle }, // ground
+            { WINDOW_WIDTH - edgeObstacle, edgeObstacle, WINDOW_HEIGHT - 2 * edgeObstacle, WINDOW_HEIGHT - edgeObstacle - groundHeight }, // right edge
+        };
     }
 
-    obstacle_vec *= obstacleWeight;
+    template <boid_state State, typename Accel>
+    static void step(boid& n, Accel accel)
+    {
+        if constexpr (State == FLYING) {
+            // update position and velocity
+            n.vel += accel();
 
-    vec2f drag_vec = -b.vel * mag(b.vel) * dragCoeff;
-    vec2f base_vec = normal(b.vel) * baseAccel;
+            if (n.pos.y < 0 && n.vel.y < 0)
+                n.vel.y = -n.vel.y;
 
-    // accelerate
-    vec2f accel = alignment_vec + cohesion_vec + avoidance_vec + flock_vec + obstacle_vec + drag_vec + base_vec; 
+            n.pos += n.vel;
+            n.dir = normal(n.vel);
+
+            if (timed_out(n.state_until)) {
+                if (n.pos.y > WINDOW_HEIGHT - groundHeight) {
+                    enter(n, TUMBLE);
+                    n.state_until = ticks_from_now(tumble_ticks(n));
+                }
+            }
+        } else if constexpr (State == TUMBLE) {
+
+            // rolls along the path it fell on, and stops at the tick worked out then
+            tumble_at(n, tickCount - n.state_since);
+
+            if (timed_out(n.state_until)) {
+                enter(n, STUNED);
+                n.state_until = ticks_from_now(120);
+            }
+        } else if constexpr (State == STUNED) {
     
-    if (debug_render != nullptr)
-    {
-        SDL_SetRenderDrawColor(debug_render, COLOR_ALIGNMENT, 255);
-        RenderVec(debug_render, b.pos, alignment_vec * debugVecMultiplier);
-        RenderCircle(debug_render, alignmentRadius, b.pos);
-        
-        SDL_SetRenderDrawColor(debug_render, COLOR_COHESION, 255);
-        RenderVec(debug_render, b.pos, cohesion_vec * debugVecMultiplier);
-        RenderCircle(debug_render, cohesionRadius, b.pos);
-        
-        SDL_SetRenderDrawColor(debug_render, COLOR_AVOIDANCE, 255);
-        RenderVec(debug_render, b.pos, avoidance_vec * debugVecMultiplier);
-        RenderCircle(debug_render, avoidanceRadius, b.pos);
-        
-        SDL_SetRenderDrawColor(debug_render, COLOR_FLOCK, 255);
-        RenderVec(debug_render, b.pos, flock_vec * debugVecMultiplier);
-        RenderCircle(debug_render, flockRadius, b.pos);
-        
-        SDL_SetRenderDrawColor(debug_render, COLOR_OBSTACLE, 255);
-        RenderVec(debug_render, b.pos, obstacle_vec * debugVecMultiplier);
-        RenderCircle(debug_render, obstacleRadius, b.pos);
-        for (const SDL_FRect& obstacle : boid_obstacles) {
-            SDL_RenderDrawRectF(debug_render, &obstacle);
-        }
+            if (timed_out(n.state_until)) {
+                n.vel = n.dir;
+                enter(n, WALKIN);
+                n.state_until = ticks_from_now(30);
+            }
+        } else if constexpr (State == WALKIN) {
 
-        SDL_SetRenderDrawColor(debug_render, COLOR_DRAG, 255);
-        RenderVec(debug_render, b.pos, drag_vec * debugVecMultiplier);
-        
-        SDL_SetRenderDrawColor(debug_render, COLOR_VELOCITY, 255);
-        RenderVec(debug_render, b.pos, base_vec * debugVecMultiplier);
-        
-        SDL_SetRenderDrawColor(debug_render, COLOR_ACCEL, 255);
-        RenderVec(debug_render, b.pos, accel * debugVecMultiplier);
-           
-        std::string s = string_format("Boid %zu pos(%+4.3f,%+4.3f) vel(%+3.3f,%+3.3f) %+3.3f flags %x state %d state timer %u", 
-                                       index, b.pos.x, b.pos.y, b.vel.x, b.vel.y, mag(b.vel), b.flags, b.state, b.state_timer);
-        RenderMessage(debug_render, 10, 13, s);
-    } 
+            n.vel += {0, -0.05};                
+            n.pos += n.vel;
+            n.dir = normal(n.vel);
 
-    return accel;
-}
+            if (n.pos.y <= WINDOW_HEIGHT - groundHeight) {
+                enter(n, FLYING);
+                n.state_until = ticks_from_now(5); // ground invuln time
+            }
+        }
+    }
 
-void RenderBoids(const std::vector<boid>& boids,SDL_Renderer* renderer)
-{
-    for (std::size_t i = 0; i < boids.size(); i++)
+    /**
+     * put n where it is ticks into a tumble. friction takes the same share of its speed every tick, so the
+     * speed decays geometrically and the distance rolled is a geometric series. a circle of radius r that
+     * rolls a distance d has turned d / r radians
+     */
+    static void tumble_at(boid& n, uint64_t ticks)
     {
-        const boid& boid = boids[i];
-        const vec2f& direction = boid.dir;
-        SDL_FPoint triangle[3]{ {boid.pos.x + boid_size * (-direction.y - direction.x), boid.pos.y + boid_size * (direction.x - direction.y)},
-                                {boid.pos.x + boid_size * direction.x , boid.pos.y + boid_size * direction.y },
-                                {boid.pos.x + boid_size * (direction.y - direction.x), boid.pos.y + boid_size * (-direction.x - direction.y)} };
-        
-        
+        const float keep = 1 - friction;
+        const float decay = std::pow(keep, float(ticks));
+        const vec2f rolled = n.start_vel * (keep * (1 - decay) / friction);
+        n.vel = n.start_vel * decay;
+        n.pos = n.start_pos + rolled;
+        n.dir = rotate(normal(n.start_vel), rolled.x / boid_size);
+    }
 
-        if (DEBUG_ENABLE == 2) {
-            if (boid.flags & FLAG_LEADER) SDL_SetRenderDrawColor(renderer, COLOR_LEADER, 255);
-            else if (boid.flags & FLAG_HANDED) SDL_SetRenderDrawColor(renderer, COLOR_LEFT, 255);
-            else SDL_SetRenderDrawColor(renderer, COLOR_RIGHT, 255);
-        } else SDL_SetRenderDrawColor(renderer, COLOR_BOID, 255);
-            
-        SDL_RenderDrawLinesF(renderer, triangle, 3);
+    /** @return the ticks a tumble from n's start lasts: until it rolls slower than stop_speed, or max_tumble */
+    static unsigned tumble_ticks(const boid& n)
+    {
+        const float estimate = std::ceil(std::log(stop_speed / mag(n.start_vel)) / std::log(1 - friction));
+
+        // the estimate can be a tick off by rounding, settle it with the same sums the tumble uses
+        boid b = n;
+        auto stopped = [&](unsigned k) { tumble_at(b, k); return mag(b.vel) < stop_speed; };
+        unsigned k = static_cast<unsigned>(clamp(estimate, 1.f, float(max_tumble)));
+        while (k > 1 && stopped(k - 1)) k--;
+        while (k < max_tumble && !stopped(k)) k++;
+        return k;
+    }
 
+    static void decorate(SDL_Renderer* renderer, const boid& boid, SDL_Color color, uint64_t tick)
+    {
         if (boid.state == STUNED) {
             const float star_radius = 2;
             const unsigned star_count = 3;
@@ -286,238 +368,352 @@ void RenderBoids(const std::vector<boid>& boids,SDL_Renderer* renderer)
             vec2f center = boid.pos + vec2f{0, -boid_size * 1.5f};
             
             for (unsigned i = 0; i < star_count; i++) {
-                float angle = boid.state_timer + i * 2 * M_PI / star_count;
+                float angle = float(boid.state_until - tick) + i * 2 * M_PI / star_count; // the stars circle until the boid gets up
                 vec2f pos = rotate({0, boid_size}, angle);
                 pos.y /= 2; pos += center;
                 stars[i] = SDL_FRect { pos.x - star_radius, pos.y - star_radius, star_radius, star_radius };
             }    
 
+            SDL_SetRenderDrawColor(renderer, color.r, color.g, color.b, color.a);
             SDL_RenderFillRectsF(renderer, stars, star_count);
         }
-
     }
+};
 
-    if (DEBUG_ENABLE == 2) {
-        calc_boid_accel(boids, 0, renderer);
-    }
+struct fish_traits {
+    typedef fish agent;
+    static constexpr fish_state interacting = SWIMING;
+    static constexpr unsigned states = 3;
+    static constexpr unsigned draws = 8;
+    static constexpr const char* name = "fish";
+    static constexpr profile_id neighbors_phase = PROFILE_FISH_NEIGHBORS, reorder_phase = PROFILE_FISH_REORDER, step_phase = PROFILE_FISH_STEP, flags_phase = PROFILE_FISH_FLAGS;
+    static constexpr float size = fish_size;
+    static constexpr SDL_Color color = { COLOR_FISH, 255 };
+    static constexpr int debug_row = -1; // it would cover the boids' details
 
-}
+    static area spawn() { return { { edgeObstacle, WINDOW_HEIGHT - waterHeight }, { WINDOW_WIDTH - edgeObstacle, WINDOW_HEIGHT - edgeObstacle } }; }
 
-void InitBoids(std::vector<boid>& boids)
-{
-    std::uniform_real_distribution<float> rand_x(edgeObstacle, WINDOW_WIDTH - edgeObstacle);
-    std::uniform_real_distribution<float> rand_y(edgeObstacle, WINDOW_HEIGHT - groundHeight);
-    std::uniform_real_distribution<float> rand_vel(-maxSpeed, maxSpeed);
-    std::uniform_int_distribution<uint8_t> rand_bit(0, 2);
-
-    for (boid& boid : boids) {
-        boid.pos.x = rand_x(generator);
-        boid.pos.y = rand_y(generator);
-        boid.vel.x = rand_vel(generator);
-        boid.vel.y = rand_vel(generator);
-        boid.dir = normal(boid.vel);
-        boid.flags = 0; 
-        boid.flags |= rand_bit(generator) << 1; // random left/right handedness
-        boid.flags |= (rand_percent(generator) < leaderChance) & 1; // random leader chance
-        boid.state_timer = 0;
-        boid.state = FLYING;
+    static std::vector<SDL_FRect> obstacles()
+    {
+        return {
+            { edgeObstacle, WINDOW_HEIGHT - waterHeight - edgeObstacle, WINDOW_WIDTH - 2 * edgeObstacle, edgeObstacle }, // top edge
+            { 0, WINDOW_HEIGHT - waterHeight, edgeObstacle, waterHeight - edgeObstacle }, // left edge
+            { WINDOW_WIDTH - edgeObstacle, WINDOW_HEIGHT - waterHeight, edgeObstacle, waterHeight - edgeObstacle }, // right edge
+            { edgeObstacle, WINDOW_HEIGHT - edgeObstacle, WINDOW_WIDTH - 2 * edgeObstacle, edgeObstacle }, // bottom edge
+        };
     }
-}
 
-void UpdateBoids()
-{
-    std::vector<boid> old_boids(boids);
-
-    boid_obstacles = { 
-        { 0, edgeObstacle, edgeObstacle, WINDOW_HEIGHT - edgeObstacle - groundHeight }, // left edge
-        { edgeObstacle, 0, WINDOW_WIDTH - 2 * edgeObstacle, edgeObstacle },  // top edge
-        { edgeObstacle, WINDOW_HEIGHT - groundHeight, WINDOW_WIDTH - 2 * edgeObstacle, edgeObstacle }, // ground
-        { WINDOW_WIDTH - edgeObstacle, edgeObstacle, WINDOW_HEIGHT - 2 * edgeObstacle, WINDOW_HEIGHT - edgeObstacle - groundHeight }, // right edge
-    };
-
-    
-    for (std::size_t i = 0; i < boids.size(); i++)
+    template <fish_state State, typename Accel>
+    static void step(fish& n, Accel accel)
     {
-        boid& n = boids[i];
+        if constexpr (State == SWIMING) {
+            // update position and velocity
+            n.vel += accel();
 
-        if (n.state_timer) { --n.state_timer; } 
-        
-        switch (n.state) {
-          
-            case FLYING: {
-                // update position and velocity
-                vec2f accel = calc_boid_accel(old_boids, i);
-                n.vel += accel;
-
-                if (n.pos.y < 0 && n.vel.y < 0)
-                    n.vel.y = -n.vel.y;
+            if (n.pos.y > WINDOW_HEIGHT && n.vel.y > 0)
+                n.vel.y = -n.vel.y;
 
-                n.pos += n.vel;
-                n.dir = normal(n.vel);
+            n.pos += n.vel;
+            n.dir = normal(n.vel);
 
-                if (!n.state_timer) {
-                    if (n.pos.y > WINDOW_HEIGHT - groundHeight) {
-                        n.state = TUMBLE;
-                        n.state_timer = 120; 
-                    }
-                }
-                break;
+            // roll for a hop before surfacing, a fish due one prepares for it even as it breaks the surface
+            if (timed_out(n.state_until) && rand_percent(n.id, draws + DRAW_HOP) < hopChance) {
+                enter(n, PREPARE);
+            } else if (n.pos.y < WINDOW_HEIGHT - waterHeight) {
+                hop(n);
             }
-            case TUMBLE: {
-
-                const float friction_coeff = 0.2;
-                n.vel -= n.vel * friction_coeff;
-                n.pos += n.vel;              
-                
-                // if a circle of radius r rolls a distance d, it has rotated d / r radians
-                n.dir = rotate(n.dir, n.vel.x / boid_size); 
-            
-                if (!n.state_timer || mag(n.vel) < 0.5) {
-                    n.state = STUNED;
-                    n.state_timer = 120;
-                }
-                break; 
-            }
-            case STUNED:
-                
-                if (!n.state_timer) {
-                    n.vel = n.dir;
-                    n.state = WALKIN;
-                    n.state_timer = 30;
-                }
-                break;
-
-            case WALKIN: {
+        } else if constexpr (State == PREPARE) {
+    
+            // swim upwards fast
+            n.vel.y += -gravity * 2;
+            n.pos += n.vel;
+            n.dir = normal(n.vel);
 
-                n.vel += {0, -0.05};                
+            if (n.pos.y < WINDOW_HEIGHT - waterHeight) {
+                hop(n);
+            }
+        } else if constexpr (State == HOPPING) {
+            bool landed;
+            if (n.state_until == stepped_hop) { // too long to work out ahead, falls one tick at a time
+                n.vel += { 0, gravity };
                 n.pos += n.vel;
-                n.dir = normal(n.vel);
+                landed = n.pos.y > WINDOW_HEIGHT - waterHeight;
+            } else { // follows the parabola it left the water on, and lands at the tick worked out then
+                hop_at(n, tickCount - n.state_since);
+                landed = timed_out(n.state_until);
+            }
 
-                if (n.pos.y <= WINDOW_HEIGHT - groundHeight) {
-                    n.state = FLYING;
-                    n.state_timer = 5; // ground invuln time
-                }
-                break;
+            if (landed) {
+                enter(n, SWIMING);
+                n.state_until = ticks_from_now(300); // hop cooldown
             }
         }
+    }
 
-        n.pos.x = wrap<float>(n.pos.x, WINDOW_WIDTH);
-        
+    static constexpr unsigned max_hop = 600; // ticks a hop is worked out ahead for at most
+    static constexpr uint64_t stepped_hop = UINT64_MAX; // the state_until of a hop that is longer, stepped until it lands
+
+    /** leave the water, landing back in it at the tick the hop's parabola crosses the water line */
+    static void hop(fish& n)
+    {
+        enter(n, HOPPING);
+        const unsigned ticks = hop_ticks(n);
+        n.state_until = ticks ? ticks_from_now(ticks) : stepped_hop;
     }
-    
-    // update flags
-    for (std::size_t i = 0; i < boids.size(); i++)
+
+    /** put n where it is ticks into a hop. gravity adds to the speed every tick, so the height is a sum of an arithmetic series */
+    static void hop_at(fish& n, uint64_t ticks)
     {
-        boid& n = boids[i];
-        if (n.state != FLYING) continue;
-        unsigned leader_neighbors = 0;
-        int handed_disparity = 0;
-        
-        for (std::size_t k = 0; k < boids.size(); k++)
-        {
-            if (k == i) continue;
-            const boid& g = boids[k];
-            if (g.state != FLYING) continue;
-
-            if (dot(n.dir, g.dir) < 0) continue; // ignore boids traveling in opposite direction
-            if (dist_squared(n.pos, g.pos) <= flockRadius * flockRadius) { 
-                if (g.flags & FLAG_LEADER) leader_neighbors++;
-                handed_disparity += g.flags & FLAG_HANDED ? 1 : -1;
-            }
-        }
-        
-        if (n.flags & FLAG_HANDED) {
-            if (handed_disparity > 0) {
-                if (rand_percent(generator) < handed_disparity * handedChance) {
-                    n.flags &= ~FLAG_HANDED;   
-                }
-            }
-        } else {
-            if (handed_disparity < 0) {
-                if (rand_percent(generator) < -handed_disparity * handedChance) {
-                    n.flags |= FLAG_HANDED;   
-                }
-            }
+        const float k = float(ticks);
+        n.vel = n.start_vel + vec2f{ 0, gravity * k };
+        n.pos = n.start_pos + n.start_vel * k + vec2f{ 0, gravity * k * (k + 1) / 2 };
+    }
+
+    /** @return the ticks a hop from n's start takes to land back in the water, 0 if it isn't down within max_hop */
+    static unsigned hop_ticks(const fish& n)
+    {
+        if (!(gravity > 0)) return 0; // the parabola never comes back down
+
+        // the first k at which gravity / 2 k^2 + (vy + gravity / 2) k + y - water > 0
+        const float water = WINDOW_HEIGHT - waterHeight;
+        const float a = gravity / 2, b = n.start_vel.y + gravity / 2, c = n.start_pos.y - water;
+        const float estimate = std::ceil((-b + std::sqrt(std::max(b * b - 4 * a * c, 0.f))) / (2 * a));
+        if (!(estimate <= max_hop)) return 0; // also when the start is not a number
+
+        // the estimate can be a tick off by rounding, settle it with the same sums the hop uses
+        fish f = n;
+        auto landed = [&](unsigned k) { hop_at(f, k); return f.pos.y > water; };
+        unsigned k = static_cast<unsigned>(std::max(estimate, 1.f));
+        while (k > 1 && landed(k - 1)) k--;
+        while (k <= max_hop && !landed(k)) k++;
+        return k <= max_hop ? k : 0;
+    }
+
+    static void decorate(SDL_Renderer*, const fish&, SDL_Color, uint64_t) {}
+};
+
+species<boid_traits> boids(100);
+species<fish_traits> fishes(100);
+
+/* the parameters the debug display edits, in the order it shows them */
+const int param_rows = 4;
+const int param_cols = 5;
+float *params[param_rows * param_cols] = { &alignmentRadius, &cohesionRadius, &avoidanceRadius, &flockRadius, &obstacleRadius,
+                                           &alignmentWeight, &cohesionWeight, &avoidanceWeight, &flockWeight, &obstacleWeight,
+                                           &maxSpeed,        &maxAccel,       &neighborSkin,    &dragCoeff,      &edgeObstacle, 
+                                           &minSpeed,        &baseAccel,      &nearestCount,    nullptr,         nullptr };
+
+/** what the main thread draws of a species, copied out of the simulation after a tick */
+template <typename Traits>
+struct species_snapshot {
+    typedef typename Traits::agent Agent;
+
+    // only the fields the renderer reads, the agents stored in the same order as in the simulation
+    std::vector<float> prev_x, prev_y, prev_dx, prev_dy; // position and direction before the tick
+    std::vector<float> x, y, dx, dy;                     // and after it
+    std::vector<unsigned> flags;
+    std::vector<typename flock<Agent>::state_type> state;
+    std::vector<uint64_t> state_until;
+    std::vector<force_record> forces;                    // empty unless recordForces is set
+    std::vector<SDL_FRect> obstacles;
+    std::size_t followed = 0;                            // index of the agent with id 0
+    Agent followed_before{};                             // every field of it before the tick, for the debug text
+
+    std::size_t size() const { return x.size(); }
+
+    void capture(const species<Traits>& s)
+    {
+        const flock<Agent>& previous = s.agents.previous();
+        const flock<Agent>& current = s.agents.current();
+        prev_x = previous.x; prev_y = previous.y;
+        prev_dx = previous.dx; prev_dy = previous.dy;
+        x = current.x; y = current.y;
+        dx = current.dx; dy = current.dy;
+        flags = current.flags;
+        state = current.state;
+        state_until = current.state_until;
+        forces = s.forces;
+        obstacles.clear();
+        s.world.for_each([&](const SDL_FRect& rect) { obstacles.push_back(rect); });
+        followed = s.agents.size() ? s.agents.index_of(0) : 0;
+        if (followed < previous.size()) followed_before = previous.load(followed);
+    }
+
+    /**
+     * @return agent i drawn alpha of the way from its previous to its current state, with only the fields
+     * the renderer reads set. Agents that wrapped around the screen during the tick are drawn where they are now
+     */
+    Agent interpolate(std::size_t i, float alpha) const
+    {
+        Agent agent{};
+        agent.pos = { x[i], y[i] };
+        agent.dir = { dx[i], dy[i] };
+        agent.flags = flags[i];
+        agent.state = state[i];
+        agent.state_until = state_until[i];
+        if (std::abs(agent.pos.x - prev_x[i]) < WINDOW_WIDTH / 2) {
+            const vec2f prev_pos{ prev_x[i], prev_y[i] }, prev_dir{ prev_dx[i], prev_dy[i] };
+            agent.pos = prev_pos + (agent.pos - prev_pos) * alpha;
+            agent.dir = normal(prev_dir + (agent.dir - prev_dir) * alpha, agent.dir);
         }
+        return agent;
+    }
+};
 
-        if (n.flags & FLAG_LEADER) {
-            // lose leadership if theres other leaders
-            if (rand_percent(generator) < leader_neighbors * leaderChance) {
-                n.flags &= ~FLAG_LEADER;
-            }
-        } else {
-            // gain leadership if there are none
-            if (leader_neighbors == 0 && rand_percent(generator) < leaderChance) {
-                n.flags |= FLAG_LEADER;
-            }
+/** everything the main thread draws, published by the simulation thread. nothing in it is shared with the simulation */
+struct world_snapshot {
+    species_snapshot<boid_traits> boids;
+    species_snapshot<fish_traits> fishes;
+    float values[param_rows * param_cols] = {}; // of params
+    std::string report; // neighbor list stats and the simulation's timings, while reportStats is set
+    uint64_t time = 0;  // performance counter when the last tick finished
+    uint64_t tick = 0;  // ticks simulated by then
+
+    /** @return the value param had in the snapshot, param must be one of params */
+    float value(const float& param) const { return values[std::find(params, params + param_rows * param_cols, &param) - params]; }
+};
+
+/**
+ * store the agents of a species in Z-order of their positions, so agents that are close together
+ * are mostly stored close together too. must be followed by a tick, see flock_buffers::reorder
+ */
+template <typename Traits>
+void ReorderFlock(species<Traits>& s)
+{
+    const flock<typename Traits::agent>& current = s.agents.current();
+    s.sort_keys.resize(current.size());
+    s.sort_order.resize(current.size());
+    pool.parallel_for(current.size(), [&](std::size_t begin, std::size_t end) {
+        for (std::size_t i = begin; i < end; i++) {
+            s.sort_keys[i] = morton_key(current.x[i], current.y[i], WINDOW_WIDTH, WINDOW_HEIGHT);
+            s.sort_order[i] = i;
         }
+    });
+    s.sorter.sort(pool, s.sort_keys, s.sort_order);
+    s.agents.reorder(s.sort_order);
+}
+
+/** @return true if alignment and cohesion come from the per cell totals instead of the neighbor lists */
+bool aggregating()
+{
+    return aggregateCell > 0 && nearestCount < 1;
+}
 
+/** @return the largest radius at which agents can affect each other through the neighbor lists */
+float neighbor_radius()
+{
+    if (aggregating()) return std::max(avoidanceRadius, flockRadius);
+    return std::max({ alignmentRadius, cohesionRadius, avoidanceRadius, flockRadius });
+}
+
+/** resize the grid cells whenever the neighbor radius has been edited */
+void FitGrid(spatial_grid& grid)
+{
+    float radius = neighbor_radius();
+    if (grid.cell_size != radius || grid.cols == 0) {
+        grid.resize(radius, WINDOW_WIDTH, WINDOW_HEIGHT);
     }
+}
 
+/** 
+ * rebuild the grid over the agents that are in the given state, and copy their
+ * neighbor fields into cells in grid order
+ */
+template <typename Agent, typename State>
+void BuildGrid(spatial_grid& grid, flock<Agent>& cells, const flock<Agent>& agents, State state)
+{
+    FitGrid(grid);
+    grid.build(agents.size(), [&](std::size_t i) { return agents.pos(i); }, 
+                              [&](std::size_t i) { return agents.state[i] == state; });
+    cells.gather(agents, grid.items);
 }
 
-/** calculate the acceleration of the fish at index, based on neighboring fish */
-vec2f calc_fish_accel(const std::vector<fish>& fishes, std::size_t index, SDL_Renderer* debug_render = nullptr)
+/** @return the query for summing the neighbor terms of an agent at pos moving at vel, terms with no weight sum nothing */
+neighbor_query make_query(const vec2f& pos, const vec2f& vel, unsigned flags)
 {
-    const fish& b = fishes[index];
+    auto r2 = [](float weight, float radius) { return weight != 0 ? radius * radius : -1; };
+    return { pos, vel, (flags & FLAG_LEADER) != 0,
+             r2(alignmentWeight, alignmentRadius), r2(cohesionWeight, cohesionRadius),
+             avoidanceRadius, avoidanceRadius * avoidanceRadius, r2(flockWeight, flockRadius) };
+}
 
-    vec2f alignment_vec{ 0, 0 }, cohesion_vec{ 0, 0 }, avoidance_vec{ 0, 0 }, flock_vec{ 0, 0 };
-    int alignment_count = 0, cohesion_count = 0, avoidance_count = 0, flock_count = 0;
+/** fill in the alignment and cohesion terms of the agent at index from the per cell totals */
+void sum_aggregates(const aggregate_grid& aggregate, const vec2f& pos, const vec2f& vel, std::size_t index, neighbor_sums& sums)
+{
+    if (alignmentWeight != 0) {
+        const aggregate_grid::totals a = aggregate.sum(pos, alignmentRadius, index);
+        sums.alignment = { float(a.vx - a.count * double(vel.x)), float(a.vy - a.count * double(vel.y)) };
+        sums.alignment_count = a.count;
+    }
+    if (cohesionWeight != 0) {
+        const aggregate_grid::totals c = aggregate.sum(pos, cohesionRadius, index);
+        sums.cohesion = { float(c.px - c.count * double(pos.x)), float(c.py - c.count * double(pos.y)) };
+        sums.cohesion_count = c.count;
+    }
+}
+
+/**
+ * @return the parts of the neighbor loop that are needed this tick: alignment and cohesion unless
+ * they come from the aggregate totals or have no weight, and avoidance if it has weight
+ */
+unsigned active_terms()
+{
+    unsigned terms = 0;
+    if (!aggregating() && (alignmentWeight != 0 || cohesionWeight != 0)) terms |= TERM_LISTED;
+    if (avoidanceWeight != 0) terms |= TERM_AVOIDANCE;
+    return terms;
+}
+
+/**
+ * calculate the acceleration of the agent at index of agents, based on its neighbors in the list of its species.
+ * Terms are the parts of the neighbor loop to compile in, see active_terms(). the terms go to record if given
+ */
+template <unsigned Terms, typename Traits>
+vec2f CalcAccel(const species<Traits>& s, const flock<typename Traits::agent>& agents, std::size_t index, force_record* record = nullptr)
+{
+    const typename Traits::agent b = agents.load(index);
+    const flock<typename Traits::agent>& cells = s.cells;
+
+    vec2f flock_vec{ 0, 0 };
+    int flock_count = 0;
     
-    for (std::size_t k = 0; k < fishes.size(); k++)
+    // g is a leader within flockRadius, stored at k in cells
+    auto follow_leader = [&](unsigned k)
     {
-        if (k == index) continue;
-        
-        const fish& g = fishes[k];
- 
-        if (g.state != SWIMING) continue;
-    
-        if (dist_squared(b.pos, g.pos) <= alignmentRadius * alignmentRadius) {
-            alignment_vec += g.vel - b.vel;
-            alignment_count++;
-        }
-        if (dist_squared(b.pos, g.pos) <= cohesionRadius * cohesionRadius) {
-            cohesion_vec += g.pos - b.pos;
-            cohesion_count++;
-        }
-        if (dist_squared(b.pos, g.pos) <= avoidanceRadius * avoidanceRadius) {
-            if ((b.flags & FLAG_LEADER) && !(g.flags & FLAG_LEADER)) { // let leaders pass to the front
-                avoidance_vec += normal(b.vel) * (avoidanceRadius - mag(b.pos - g.pos));
-            } else {
-                avoidance_vec += normal(b.pos - g.pos) * (avoidanceRadius - mag(b.pos - g.pos));
-            }
-            avoidance_count++;
+        const vec2f g_pos = cells.pos(k), g_dir = cells.dir(k);
+        if (dot(b.dir, g_dir) < 0) return; // ignore agents not traveling in the same direction
+
+        vec2f tail = -g_dir; // vec backwards from g
+        vec2f g_to_b = b.pos - g_pos;  // vec from g to b
+        vec2f rej;
+        if (dot(g_to_b, g_dir) > 0) { // fall behind leader
+            vec2f p = proj(g_to_b, tail);
+            rej = p;
+        } else { // attempt to make a triangular looking flock
+            float rot = flockAngle * (b.flags & FLAG_HANDED ? 1 : -1);
+            tail = rotate(tail, rot); // rotate tail vector in handedness of b
+            vec2f p = proj(g_to_b, tail);
+            rej = g_to_b - p; // rejection from tail vector to b
         }
-        if (dist_squared(b.pos, g.pos) <= flockRadius * flockRadius) { 
-
-            if (!(g.flags & FLAG_LEADER)) continue; // only flock on leaders
-            if (dot(b.dir, g.dir) < 0) continue; // ignore boids not traveling in the same direction
-
-            vec2f tail = -g.dir; // vec backwards from g
-            vec2f g_to_b = b.pos - g.pos;  // vec from g to b
-            vec2f rej;
-            if (dot(g_to_b, g.dir) > 0) { // fall behind leader
-                vec2f p = proj(g_to_b, tail);
-                rej = p;
-            } else { // attempt to make a triangular looking flock
-                float rot = flockAngle * (b.flags & FLAG_HANDED ? 1 : -1);
-                tail = rotate(tail, rot); // rotate tail vector in handedness of b
-                vec2f p = proj(g_to_b, tail);
-                rej = g_to_b - p; // rejection from tail vector to b
-            }
 
-            float tmp = mag(rej) - .75 * flockRadius;
-            rej = normal(rej) * ((-1 / (.75 * flockRadius)) * tmp * tmp + (flockRadius * .75));
-            flock_vec += -rej; // move b towards tail vector
-            flock_count++;
+        float tmp = mag(rej) - .75 * flockRadius;
+        rej = normal(rej) * ((-1 / (.75 * flockRadius)) * tmp * tmp + (flockRadius * .75));
+        flock_vec += -rej; // move b towards tail vector
+        flock_count++;
 
-            if (debug_render != nullptr)
-            {
-                SDL_SetRenderDrawColor(debug_render, COLOR_LEADER, 255);
-                RenderVec(debug_render, g.pos, tail * flockRadius);
-            }
+        if (record != nullptr) {
+            record->leader_pos = g_pos;
+            record->leader_tail = tail;
         }
-    }
+    };
+
+    const neighbor_query query = make_query(b.pos, b.vel, b.flags);
+    neighbor_sums sums;
+    accumulate_neighbors<Terms>(query, cells, s.neighbors, index, sums, follow_leader);
+    if (aggregating()) sum_aggregates(s.aggregate, b.pos, b.vel, index, sums);
+
+    vec2f alignment_vec = sums.alignment, cohesion_vec = sums.cohesion, avoidance_vec = sums.avoidance;
+    const int alignment_count = sums.alignment_count, cohesion_count = sums.cohesion_count, avoidance_count = sums.avoidance_count;
 
     if (alignment_count > 0) {
         alignment_vec /= alignment_count; 
@@ -537,18 +733,15 @@ vec2f calc_fish_accel(const std::vector<fish>& fishes, std::size_t index, SDL_Re
 
     vec2f obstacle_vec{ 0, 0 };
     
-    vec2f closest_vec{INFINITY, INFINITY};
-    for (const SDL_FRect& obstacle : fish_obstacles) {
-        vec2f ob = vec_to(b.pos, obstacle);
-        if (mag(ob) > obstacleRadius) continue; // skip if outside obstacle avoidance radius
-        if (dot(ob, b.vel) < 0) continue; // skip if not headed toward the obstacle
-        if (mag(ob) < mag(closest_vec)) closest_vec = ob;
-    }
-    if (mag(closest_vec) != INFINITY) {
-        obstacle_vec += -normal(closest_vec - proj(closest_vec, b.vel)) * (obstacleRadius - mag(closest_vec)); 
-    }
+    if (obstacleWeight != 0) {
+        // the closest obstacle within the avoidance radius that we're headed toward
+        vec2f closest_vec = s.world.closest(b.pos, obstacleRadius, [&](const vec2f& ob) { return dot(ob, b.vel) >= 0; });
+        if (mag(closest_vec) != INFINITY) {
+            obstacle_vec += -normal(closest_vec - proj(closest_vec, b.vel)) * (obstacleRadius - mag(closest_vec)); 
+        }
 
-    obstacle_vec *= obstacleWeight;
+        obstacle_vec *= obstacleWeight;
+    }
 
     vec2f drag_vec = -b.vel * mag(b.vel) * dragCoeff;
     vec2f base_vec = normal(b.vel) * baseAccel;
@@ -556,247 +749,546 @@ vec2f calc_fish_accel(const std::vector<fish>& fishes, std::size_t index, SDL_Re
     // accelerate
     vec2f accel = alignment_vec + cohesion_vec + avoidance_vec + flock_vec + obstacle_vec + drag_vec + base_vec; 
     
-    if (debug_render != nullptr)
-    {
-        SDL_SetRenderDrawColor(debug_render, COLOR_ALIGNMENT, 255);
-        RenderVec(debug_render, b.pos, alignment_vec * debugVecMultiplier);
-        RenderCircle(debug_render, alignmentRadius, b.pos);
-        
-        SDL_SetRenderDrawColor(debug_render, COLOR_COHESION, 255);
-        RenderVec(debug_render, b.pos, cohesion_vec * debugVecMultiplier);
-        RenderCircle(debug_render, cohesionRadius, b.pos);
-        
-        SDL_SetRenderDrawColor(debug_render, COLOR_AVOIDANCE, 255);
-        RenderVec(debug_render, b.pos, avoidance_vec * debugVecMultiplier);
-        RenderCircle(debug_render, avoidanceRadius, b.pos);
-        
-        SDL_SetRenderDrawColor(debug_render, COLOR_FLOCK, 255);
-        RenderVec(debug_render, b.pos, flock_vec * debugVecMultiplier);
-        RenderCircle(debug_render, flockRadius, b.pos);
-        
-        SDL_SetRenderDrawColor(debug_render, COLOR_OBSTACLE, 255);
-        RenderVec(debug_render, b.pos, obstacle_vec * debugVecMultiplier);
-        RenderCircle(debug_render, obstacleRadius, b.pos);
-        for (const SDL_FRect& obstacle : fish_obstacles) {
-            SDL_RenderDrawRectF(debug_render, &obstacle);
-        }
-
-        SDL_SetRenderDrawColor(debug_render, COLOR_DRAG, 255);
-        RenderVec(debug_render, b.pos, drag_vec * debugVecMultiplier);
-        
-        SDL_SetRenderDrawColor(debug_render, COLOR_VELOCITY, 255);
-        RenderVec(debug_render, b.pos, base_vec * debugVecMultiplier);
-        
-        SDL_SetRenderDrawColor(debug_render, COLOR_ACCEL, 255);
-        RenderVec(debug_render, b.pos, accel * debugVecMultiplier);
-           
-        // std::string s = string_format("Fish %zu pos(%+4.3f,%+4.3f) vel(%+3.3f,%+3.3f) %+3.3f flags %x state %d state timer %u", 
-        //                                index, b.pos.x, b.pos.y, b.vel.x, b.vel.y, mag(b.vel), b.flags, b.state, b.state_timer);
-        // RenderMessage(debug_render, 10, 13, s);
-    } 
+    if (record != nullptr) {
+        record->recorded = true;
+        record->pos = b.pos;
+        record->alignment = alignment_vec; record->cohesion = cohesion_vec; record->avoidance = avoidance_vec;
+        record->flock = flock_vec; record->obstacle = obstacle_vec; record->drag = drag_vec; record->base = base_vec;
+        record->accel = accel;
+    }
 
     return accel;
 }
 
-void RenderFish(const std::vector<fish>& fishes,SDL_Renderer* renderer)
+line_batch agentLines; // every agent of a species is drawn in one batch
+
+/**
+ * draw the force terms recorded in the last tick, every term of every agent if debugAllAgents is set,
+ * and the radii and obstacles around the followed agent
+ */
+template <typename Traits>
+void RenderForces(const species_snapshot<Traits>& s, const world_snapshot& world, SDL_Renderer* renderer)
+{
+    auto add_terms = [&](const force_record& r) {
+        const std::pair<vec2f, SDL_Color> terms[] = {
+            { r.alignment, { COLOR_ALIGNMENT, 255 } }, { r.cohesion, { COLOR_COHESION, 255 } }, { r.avoidance, { COLOR_AVOIDANCE, 255 } },
+            { r.flock, { COLOR_FLOCK, 255 } }, { r.obstacle, { COLOR_OBSTACLE, 255 } }, { r.drag, { COLOR_DRAG, 255 } },
+            { r.base, { COLOR_VELOCITY, 255 } }, { r.accel, { COLOR_ACCEL, 255 } },
+        };
+        for (const auto& term : terms) agentLines.add(r.pos, r.pos + term.first * debugVecMultiplier, term.second);
+        if (mag(r.leader_tail) != 0) agentLines.add(r.leader_pos, r.leader_pos + r.leader_tail * world.value(flockRadius), { COLOR_LEADER, 255 });
+    };
+
+    const std::size_t followed = s.followed;
+    if (debugAllAgents) {
+        for (std::size_t i = 0; i < s.forces.size(); i++) if (s.forces[i].recorded && i != followed) add_terms(s.forces[i]);
+    }
+    if (followed >= s.forces.size() || !s.forces[followed].recorded) {
+        agentLines.draw(renderer);
+        return;
+    }
+    const force_record& r = s.forces[followed];
+    add_terms(r);
+    agentLines.draw(renderer);
+
+    const std::pair<float, SDL_Color> radii[] = {
+        { world.value(alignmentRadius), { COLOR_ALIGNMENT, 255 } }, { world.value(cohesionRadius), { COLOR_COHESION, 255 } },
+        { world.value(avoidanceRadius), { COLOR_AVOIDANCE, 255 } }, { world.value(flockRadius), { COLOR_FLOCK, 255 } },
+        { world.value(obstacleRadius), { COLOR_OBSTACLE, 255 } },
+    };
+    for (const auto& radius : radii) {
+        SDL_SetRenderDrawColor(renderer, radius.second.r, radius.second.g, radius.second.b, radius.second.a);
+        RenderCircle(renderer, radius.first, r.pos);
+    }
+    SDL_SetRenderDrawColor(renderer, COLOR_OBSTACLE, 255);
+    for (const SDL_FRect& obstacle : s.obstacles) SDL_RenderDrawRectF(renderer, &obstacle);
+
+    if (Traits::debug_row >= 0) {
+        const typename Traits::agent& b = s.followed_before; // the state the forces were found for
+        std::string text = string_format("%s %zu pos(%+4.3f,%+4.3f) vel(%+3.3f,%+3.3f) %+3.3f flags %x state %d state until %llu", 
+                                         Traits::name, followed, b.pos.x, b.pos.y, b.vel.x, b.vel.y, mag(b.vel), b.flags, b.state, (unsigned long long)b.state_until);
+        RenderMessage(renderer, 10, Traits::debug_row, text);
+    }
+}
+
+template <typename Traits>
+void RenderSpecies(const species_snapshot<Traits>& s, const world_snapshot& world, float alpha, SDL_Renderer* renderer)
 {
-    for (std::size_t i = 0; i < fishes.size(); i++)
+    const float size = Traits::size;
+    for (std::size_t i = 0; i < s.size(); i++)
     {
-        const fish& fish = fishes[i];
-        const vec2f& direction = fish.dir;
-        SDL_FPoint triangle[3]{ {fish.pos.x + boid_size * (-direction.y - direction.x), fish.pos.y + boid_size * (direction.x - direction.y)},
-                                {fish.pos.x + boid_size * direction.x , fish.pos.y + boid_size * direction.y },
-                                {fish.pos.x + boid_size * (direction.y - direction.x), fish.pos.y + boid_size * (-direction.x - direction.y)} };
-        
-        
+        const typename Traits::agent agent = s.interpolate(i, alpha);
+        const vec2f& direction = agent.dir;
+        const vec2f left  { agent.pos.x + size * (-direction.y - direction.x), agent.pos.y + size * (direction.x - direction.y) };
+        const vec2f tip   { agent.pos.x + size * direction.x, agent.pos.y + size * direction.y };
+        const vec2f right { agent.pos.x + size * (direction.y - direction.x), agent.pos.y + size * (-direction.x - direction.y) };
 
+        SDL_Color color = Traits::color;
         if (DEBUG_ENABLE == 2) {
-            if (fish.flags & FLAG_LEADER) SDL_SetRenderDrawColor(renderer, COLOR_LEADER, 255);
-            else if (fish.flags & FLAG_HANDED) SDL_SetRenderDrawColor(renderer, COLOR_LEFT, 255);
-            else SDL_SetRenderDrawColor(renderer, COLOR_RIGHT, 255);
-        } else SDL_SetRenderDrawColor(renderer, COLOR_FISH, 255);
-            
-        SDL_RenderDrawLinesF(renderer, triangle, 3);
+            if (agent.flags & FLAG_LEADER) color = { COLOR_LEADER, 255 };
+            else if (agent.flags & FLAG_HANDED) color = { COLOR_LEFT, 255 };
+            else color = { COLOR_RIGHT, 255 };
+        }
 
-    }
+        agentLines.add(left, tip, color);
+        agentLines.add(tip, right, color);
 
-    if (DEBUG_ENABLE == 2) {
-        calc_fish_accel(fishes, 0, renderer);
+        Traits::decorate(renderer, agent, color, world.tick);
     }
 
+    agentLines.draw(renderer);
+
+    if (DEBUG_ENABLE == 2) RenderForces(s, world, renderer);
 }
 
-void InitFish(std::vector<fish>& fishes)
+template <typename Traits>
+void InitSpecies(species<Traits>& s)
 {
-    std::uniform_real_distribution<float> rand_x(edgeObstacle, WINDOW_WIDTH - edgeObstacle);
-    std::uniform_real_distribution<float> rand_y(WINDOW_HEIGHT - waterHeight, WINDOW_HEIGHT - edgeObstacle);
-    std::uniform_real_distribution<float> rand_vel(-maxSpeed, maxSpeed);
-    std::uniform_int_distribution<uint8_t> rand_bit(0, 2);
-
-    for (fish& fish : fishes) {
-        fish.pos.x = rand_x(generator);
-        fish.pos.y = rand_y(generator);
-        fish.vel.x = rand_vel(generator);
-        fish.vel.y = rand_vel(generator);
-        fish.dir = normal(fish.vel);
-        fish.flags = 0; 
-        fish.flags |= rand_bit(generator) << 1; // random left/right handedness
-        fish.flags |= (rand_percent(generator) < leaderChance) & 1; // random leader chance
-        fish.state_timer = 0;
-        fish.state = SWIMING;
-    }
+    flock<typename Traits::agent>& current = s.agents.current();
+    const area spawn = Traits::spawn();
+    pool.parallel_for(current.size(), [&](std::size_t begin, std::size_t end) {
+        for (std::size_t i = begin; i < end; i++) {
+            typename Traits::agent agent;
+            agent.pos.x = rand_range(spawn.min.x, spawn.max.x, i, Traits::draws + DRAW_INIT_X);
+            agent.pos.y = rand_range(spawn.min.y, spawn.max.y, i, Traits::draws + DRAW_INIT_Y);
+            agent.vel.x = rand_range(-maxSpeed, maxSpeed, i, Traits::draws + DRAW_INIT_VX);
+            agent.vel.y = rand_range(-maxSpeed, maxSpeed, i, Traits::draws + DRAW_INIT_VY);
+            agent.dir = normal(agent.vel);
+            agent.flags = 0; 
+            if (rand_percent(i, Traits::draws + DRAW_INIT_HANDED) < 0.5f) agent.flags |= FLAG_HANDED; // random left/right handedness
+            if (rand_percent(i, Traits::draws + DRAW_INIT_LEADER) < leaderChance) agent.flags |= FLAG_LEADER; // random leader chance
+            agent.state_since = agent.state_until = 0;
+            agent.start_pos = agent.pos;
+            agent.start_vel = agent.vel;
+            agent.id = i;
+            agent.state = Traits::interacting;
+            current.store(i, agent);
+        }
+    });
+    s.agents.sync();
+    s.states.build(current);
 }
 
-void UpdateFish(std::vector<fish>& fishes)
+/** advance the agents of a species that are in State by one tick, with the neighbor loop compiled for Terms */
+template <unsigned Terms, typename Traits, unsigned State>
+void StepState(species<Traits>& s, force_record* records)
 {
+    typedef typename Traits::agent Agent;
+    const flock<Agent>& old_agents = s.agents.current();
+    flock<Agent>& new_agents = s.agents.next();
+    const std::vector<unsigned>& members = s.states.members[State];
+
+    // each agent only reads the old population and writes itself, so they can be updated in parallel
+    pool.parallel_for(members.size(), [&](std::size_t begin, std::size_t end) {
+        for (std::size_t k = begin; k < end; k++)
+        {
+            const unsigned i = members[k];
+            if (i == s.states.gone) continue;
+            Agent n = old_agents.load(i);
 
-    std::vector<fish> old_fishes(fishes);
+            Traits::template step<static_cast<typename flock<Agent>::state_type>(State)>(n, [&] { return CalcAccel<Terms>(s, old_agents, i, records ? &records[i] : nullptr); });
 
-    fish_obstacles = { 
-        { edgeObstacle, WINDOW_HEIGHT - waterHeight - edgeObstacle, WINDOW_WIDTH - 2 * edgeObstacle, edgeObstacle }, // top edge
-        { 0, WINDOW_HEIGHT - waterHeight, edgeObstacle, waterHeight - edgeObstacle }, // left edge
-        { WINDOW_WIDTH - edgeObstacle, WINDOW_HEIGHT - waterHeight, edgeObstacle, waterHeight - edgeObstacle }, // right edge
-        { edgeObstacle, WINDOW_HEIGHT - edgeObstacle, WINDOW_WIDTH - 2 * edgeObstacle, edgeObstacle }, // bottom edge
-    };
+            n.pos.x = wrap<float>(n.pos.x, WINDOW_WIDTH);
+            new_agents.store(i, n);
+            if (n.state != State) s.states.record(i);
+        }
+    });
+}
 
-    
-    for (std::size_t i = 0; i < fishes.size(); i++)
-    {
-        fish& n = fishes[i];
+/** run StepState for each of States in turn */
+template <unsigned Terms, typename Traits, unsigned... States>
+void StepStates(species<Traits>& s, force_record* records, std::integer_sequence<unsigned, States...>)
+{
+    (StepState<Terms, Traits, States>(s, records), ...);
+}
 
-        if (n.state_timer) { --n.state_timer; } 
-        
-        switch (n.state) {
-          
-            case SWIMING: {
-                // update position and velocity
-                vec2f accel = calc_fish_accel(old_fishes, i);
-                n.vel += accel;
+/** advance every agent of a species by one tick, with the neighbor loop compiled for Terms */
+template <unsigned Terms, typename Traits>
+void StepAgents(species<Traits>& s, force_record* records)
+{
+    StepStates<Terms>(s, records, std::make_integer_sequence<unsigned, Traits::states>());
+}
 
-                if (n.pos.y > WINDOW_HEIGHT && n.vel.y > 0)
-                    n.vel.y = -n.vel.y;
+/** @return StepAgents for each combination of the terms in force_term, indexed by the terms */
+template <typename Traits, std::size_t... Terms>
+constexpr std::array<void (*)(species<Traits>&, force_record*), sizeof...(Terms)> StepTable(std::index_sequence<Terms...>)
+{
+    return { &StepAgents<Terms, Traits>... };
+}
 
-                n.pos += n.vel;
-                n.dir = normal(n.vel);
+/** reorder the agents of a species when it's due, then find the neighbors of every agent and the obstacles around them */
+template <typename Traits>
+void FindNeighbors(species<Traits>& s)
+{
+    typedef typename Traits::agent Agent;
+
+    if (reorderInterval && tickCount % reorderInterval == 0) {
+        scoped_timer timer(profile[Traits::reorder_phase]);
+        ReorderFlock(s);
+        s.verlet.reset();
+        s.states.build(s.agents.current());
+    } else {
+        s.states.update(s.agents.current());
+    }
 
-                if (n.pos.y < WINDOW_HEIGHT - waterHeight) {
-                    n.state = HOPPING;
-                }
+    const flock<Agent>& old_agents = s.agents.current();
+    auto include = [&](std::size_t i) { return old_agents.state[i] == Traits::interacting; };
+    if (nearestCount >= 1) {
+        BuildGrid(s.grid, s.cells, old_agents, Traits::interacting);
+        s.tree.build(pool, s.cells.size(), [&](std::size_t k) { return s.cells.pos(k); });
+        s.neighbors.build_nearest(pool, old_agents, s.tree, s.grid.items, static_cast<unsigned>(nearestCount), neighbor_radius(), include);
+        s.verlet.reset();
+    } else if (neighborSkin > 0) {
+        FitGrid(s.grid);
+        s.verlet.update(pool, old_agents, s.grid, s.cells, neighbor_radius(), neighborSkin, include, s.neighbors);
+    } else {
+        BuildGrid(s.grid, s.cells, old_agents, Traits::interacting);
+        s.neighbors.build(pool, old_agents, s.grid, s.cells, neighbor_radius(), include);
+        s.verlet.reset();
+    }
+    if (aggregating()) {
+        s.aggregate.build(pool, old_agents, aggregateCell, WINDOW_WIDTH, WINDOW_HEIGHT, include);
+        // the check sums neighbor by neighbor, only worth it while the error is shown
+        if (reportStats || headlessTicks) s.aggregate.check(std::max(alignmentRadius, cohesionRadius), 64);
+    }
 
-                if (!n.state_timer) {
-                    if (rand_percent(generator) < hopChance) {
-                        n.state = PREPARE;
-                    }
-                }
-                break;
-            }
-            case PREPARE: {
-                
-                // swim upwards fast
-                n.vel.y += -gravity * 2;
-                n.pos += n.vel;
-                n.dir = normal(n.vel);
-            
-                if (n.pos.y < WINDOW_HEIGHT - waterHeight) {
-                    n.state = HOPPING;
-                }
-                break; 
-            }
-            case HOPPING:
-                n.vel += { 0, gravity };
-                n.pos += n.vel;
+    // only rebuilds the obstacle tree when the edge setting changed
+    if (s.obstacle_version != obstacleVersion) {
+        s.world.set_static(Traits::obstacles(), &obstacleMap);
+        s.obstacle_version = obstacleVersion;
+    }
+}
 
-                if (n.pos.y > WINDOW_HEIGHT - waterHeight) {
-                    n.state = SWIMING;
-                    n.state_timer = 300; // hop cooldown
-                }
-                break;
+/** move every agent of a species by one tick, the agents from before it become previous() */
+template <typename Traits>
+void StepSpecies(species<Traits>& s)
+{
+    // the force terms are only kept while the debug display shows them
+    force_record* records = nullptr;
+    if (recordForces) {
+        s.forces.assign(s.agents.size(), {});
+        records = s.forces.data();
+    } else {
+        s.forces.clear();
+    }
 
-        }
+    // the step compiled for the parts of the neighbor loop that are needed
+    static constexpr auto steps = StepTable<Traits>(std::make_index_sequence<TERM_ALL + 1>());
+    steps[active_terms()](s, records);
+    s.agents.swap();
+}
 
-        n.pos.x = wrap<float>(n.pos.x, WINDOW_WIDTH);
-        
-    }
-    
-    // update flags
-    for (std::size_t i = 0; i < fishes.size(); i++)
-    {
-        fish& n = fishes[i];
-        if (n.state != SWIMING) continue;
-        unsigned leader_neighbors = 0;
-        int handed_disparity = 0;
-        
-        for (std::size_t k = 0; k < fishes.size(); k++)
+/** update the leader and handedness flags of the agents a species just stepped */
+template <typename Traits>
+void UpdateFlags(species<Traits>& s)
+{
+    typedef typename Traits::agent Agent;
+    const flock<Agent>& old_agents = s.agents.previous();
+    flock<Agent>& new_agents = s.agents.current();
+
+    // flags follow the neighbors found at the start of the tick, read from the cells, a snapshot of the
+    // flags from before this pass, so every agent sees the same neighbors no matter what order they are updated in
+    const std::vector<unsigned>& members = s.states.members[Traits::interacting];
+    pool.parallel_for(members.size(), [&](std::size_t begin, std::size_t end) {
+        for (std::size_t m = begin; m < end; m++)
         {
-            if (k == i) continue;
-            const fish& g = fishes[k];
-            if (g.state != SWIMING) continue;
-
-            if (dot(n.dir, g.dir) < 0) continue; // ignore boids traveling in opposite direction
-            if (dist_squared(n.pos, g.pos) <= flockRadius * flockRadius) { 
-                if (g.flags & FLAG_LEADER) leader_neighbors++;
-                handed_disparity += g.flags & FLAG_HANDED ? 1 : -1;
+            const unsigned i = members[m];
+            if (i == s.states.gone) continue;
+            unsigned leader_neighbors = 0;
+            int handed_disparity = 0;
+    
+            const vec2f n_dir = old_agents.dir(i);
+            const unsigned n_id = old_agents.id[i];
+            unsigned& n_flags = new_agents.flags[i];
+    
+            for (unsigned e = s.neighbors.start[i]; e < s.neighbors.start[i + 1]; e++) {
+                const unsigned k = s.neighbors.cell[e];
+                if (s.neighbors.dist2[e] > flockRadius * flockRadius) continue;
+                if (dot(n_dir, s.cells.dir(k)) < 0) continue; // ignore agents traveling in opposite direction
+                if (s.cells.flags[k] & FLAG_LEADER) leader_neighbors++;
+                handed_disparity += s.cells.flags[k] & FLAG_HANDED ? 1 : -1;
             }
-        }
-        
-        if (n.flags & FLAG_HANDED) {
-            if (handed_disparity > 0) {
-                if (rand_percent(generator) < handed_disparity * handedChance) {
-                    n.flags &= ~FLAG_HANDED;   
+    
+            if (n_flags & FLAG_HANDED) {
+                if (handed_disparity > 0) {
+                    if (rand_percent(n_id, Traits::draws + DRAW_FLIP_HANDED) < handed_disparity * handedChance) {
+                        n_flags &= ~FLAG_HANDED;   
+                    }
+                }
+            } else {
+                if (handed_disparity < 0) {
+                    if (rand_percent(n_id, Traits::draws + DRAW_FLIP_HANDED) < -handed_disparity * handedChance) {
+                        n_flags |= FLAG_HANDED;   
+                    }
                 }
             }
-        } else {
-            if (handed_disparity < 0) {
-                if (rand_percent(generator) < -handed_disparity * handedChance) {
-                    n.flags |= FLAG_HANDED;   
+
+            if (n_flags & FLAG_LEADER) {
+                // lose leadership if theres other leaders
+                if (rand_percent(n_id, Traits::draws + DRAW_FLIP_LEADER) < leader_neighbors * leaderChance) {
+                    n_flags &= ~FLAG_LEADER;
+                }
+            } else {
+                // gain leadership if there are none
+                if (leader_neighbors == 0 && rand_percent(n_id, Traits::draws + DRAW_FLIP_LEADER) < leaderChance) {
+                    n_flags |= FLAG_LEADER;
                 }
             }
+
         }
+    });
 
-        if (n.flags & FLAG_LEADER) {
-            // lose leadership if theres other leaders
-            if (rand_percent(generator) < leader_neighbors * leaderChance) {
-                n.flags &= ~FLAG_LEADER;
-            }
-        } else {
-            // gain leadership if there are none
-            if (leader_neighbors == 0 && rand_percent(generator) < leaderChance) {
-                n.flags |= FLAG_LEADER;
-            }
+}
+
+
+/** add the phases of a tick of one species to graph, each waiting for the one before */
+template <typename Traits>
+void AddSpeciesTasks(task_graph& graph, species<Traits>& s)
+{
+    const unsigned neighbors = graph.add([&s] { FindNeighbors(s); }, &profile[Traits::neighbors_phase]);
+    const unsigned step = graph.add([&s] { StepSpecies(s); }, &profile[Traits::step_phase], { neighbors });
+    graph.add([&s] { UpdateFlags(s); }, &profile[Traits::flags_phase], { step });
+}
+
+task_graph tickTasks; // boids and fish never meet, so their phases run side by side
+
+/** advance the whole simulation by one tick */
+void UpdateWorld()
+{
+    scoped_timer timer(profile[PROFILE_TICK]);
+    if (tickTasks.tasks.empty()) {
+        AddSpeciesTasks(tickTasks, boids);
+        AddSpeciesTasks(tickTasks, fishes);
+    }
+    tickTasks.run(pool);
+    tickCount++;
+}
+
+/** @return how often the verlet candidates of a species were searched again, and the average list lengths */
+template <typename Traits>
+std::string VerletReport(const species<Traits>& s)
+{
+    const verlet_list& verlet = s.verlet;
+    const neighbor_list& neighbors = s.neighbors;
+    if (neighborSkin <= 0 || verlet.ticks == 0 || neighbors.size() == 0) return "";
+    return string_format("%-6s searched %5.1f%% of %llu ticks, %6.1f candidates %6.1f neighbors per agent\n", Traits::name,
+                         100. * verlet.searches / verlet.ticks, verlet.ticks,
+                         double(verlet.candidates.cell.size()) / neighbors.size(), double(neighbors.cell.size()) / neighbors.size());
+}
+
+/** @return the error of the per cell totals found by the last check, against summing neighbor by neighbor */
+template <typename Traits>
+std::string AggregateReport(const species<Traits>& s)
+{
+    const aggregate_grid& aggregate = s.aggregate;
+    if (!aggregating() || aggregate.samples == 0) return "";
+    return string_format("%-6s aggregates off by up to %.2e px in mean position, %.2e px/tick in mean velocity over %u samples\n", Traits::name,
+                         aggregate.position_error, aggregate.velocity_error, aggregate.samples);
+}
+
+/** @return FNV-1a hash of every agent's position and flags, equal between runs that simulated the same thing */
+uint64_t StateChecksum()
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    auto mix = [&](const void* data, std::size_t bytes) {
+        for (std::size_t i = 0; i < bytes; i++) hash = (hash ^ static_cast<const unsigned char*>(data)[i]) * 0x100000001b3ull;
+    };
+    // in id order, so it doesn't depend on how the agents happen to be stored
+    auto mix_species = [&](const auto& agents) {
+        for (unsigned id = 0; id < agents.size(); id++) {
+            const std::size_t i = agents.index_of(id);
+            mix(&agents.current().x[i], sizeof(float));
+            mix(&agents.current().y[i], sizeof(float));
+            mix(&agents.current().flags[i], sizeof(unsigned));
         }
+    };
+    mix_species(boids.agents);
+    mix_species(fishes.agents);
+    return hash;
+}
+
+/** simulate ticks as fast as possible without a window or renderer, then report the tick rate */
+int RunHeadless(uint64_t ticks)
+{
+    InitSpecies(boids);
+    InitSpecies(fishes);
+
+    const uint64_t start = SDL_GetPerformanceCounter();
+    for (uint64_t t = 0; t < ticks; t++) UpdateWorld();
+    const double seconds = double(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency();
+
+    printf("%llu ticks of %zu boids and %zu fish in %.3f s\n", (unsigned long long)ticks, boids.agents.size(), fishes.agents.size(), seconds);
+    printf("%.1f ticks/s, %.3f ms/tick\n", ticks / seconds, seconds * 1000 / ticks);
+    printf("checksum %016llx\n", (unsigned long long)StateChecksum());
+    printf("%s", (VerletReport(boids) + VerletReport(fishes)).c_str());
+    printf("%s", (AggregateReport(boids) + AggregateReport(fishes)).c_str());
+    printf("timings of the last %u calls\n%s", profile_phase::profile_window, profile_report(profile, PROFILE_COUNT).c_str());
+    return 0;
+}
+
+/* messages from the main thread to the simulation thread */
+enum command_type {
+    COMMAND_ADJUST,      // add value to params[param]
+    COMMAND_RESET,       // respawn every agent
+    COMMAND_SINGLE_TICK, // toggle between running freely and one tick at a time
+    COMMAND_ADVANCE,     // run the next tick
+    COMMAND_DEBUG,       // the debug display changed to value
+    COMMAND_QUIT,
+};
+
+struct command {
+    command_type type;
+    int param;
+    float value;
+};
 
+/*
+ * the simulation runs on its own thread, so it keeps ticking while the main thread
+ * waits for vsync. it publishes a snapshot after each batch of due ticks, which the main thread
+ * draws the newest of, and takes input and parameter edits as commands
+ */
+triple_buffer<world_snapshot> snapshots;
+message_queue<command> commands;
+
+// owned by the simulation thread once it runs
+double tickAccumulator = 0; // real time not yet simulated, in seconds
+uint64_t lastTick = 0;      // performance counter when the simulation last caught up
+uint64_t tickTime = 0;      // performance counter when the last tick finished
+bool do_tick = true;
+bool single_tick = false;
+
+/** copy what the main thread draws into a snapshot and publish it */
+void Publish()
+{
+    scoped_timer timer(profile[PROFILE_PUBLISH]);
+    world_snapshot& snapshot = snapshots.write();
+    snapshot.boids.capture(boids);
+    snapshot.fishes.capture(fishes);
+    for (int i = 0; i < param_rows * param_cols; i++) snapshot.values[i] = params[i] != nullptr ? *params[i] : 0;
+    snapshot.report.clear();
+    if (reportStats) {
+        snapshot.report = VerletReport(boids) + VerletReport(fishes) + AggregateReport(boids) + AggregateReport(fishes)
+                        + profile_report(profile, PROFILE_FRAME);
     }
+    snapshot.time = tickTime;
+    snapshot.tick = tickCount;
+    snapshots.publish();
+}
 
+/** apply the commands sent since the last call, waiting up to timeout milliseconds for one. @return false once told to quit */
+bool ApplyCommands(Uint32 timeout)
+{
+    static std::vector<command> received;
+    commands.receive(received, timeout);
+    for (const command& c : received) {
+        switch (c.type) {
+        case COMMAND_ADJUST:
+            *params[c.param] += c.value;
+            if (params[c.param] == &edgeObstacle) obstacleVersion++;
+            break;
+        case COMMAND_RESET:       InitSpecies(boids); InitSpecies(fishes); break;
+        case COMMAND_SINGLE_TICK: single_tick = !single_tick; break;
+        case COMMAND_ADVANCE:     do_tick = true; break;
+        case COMMAND_DEBUG:       recordForces = c.value == 2; reportStats = c.value != 0; break;
+        case COMMAND_QUIT:        return false;
+        }
+    }
+    if (!received.empty()) Publish(); // show the edits while paused too
+    return true;
 }
 
+/** run the ticks that are due by now and publish the last one, @return milliseconds until the next one is */
+Uint32 RunDueTicks()
+{
+    const uint64_t now = SDL_GetPerformanceCounter();
+    if (lastTick) tickAccumulator += double(now - lastTick) / SDL_GetPerformanceFrequency();
+    lastTick = now;
+    tickAccumulator = std::min(tickAccumulator, maxTicksBehind * tickSeconds);
+
+    // the renderer only ever draws the newest tick, so the ones before it in a batch aren't copied out
+    bool ticked = false;
+    auto tick = [&] {
+        UpdateWorld();
+        tickTime = SDL_GetPerformanceCounter();
+        ticked = true;
+    };
+    if (do_tick) {
+        if (single_tick) {
+            tick();
+            do_tick = false;
+        } else while (tickAccumulator >= tickSeconds) {
+            tick();
+            tickAccumulator -= tickSeconds;
+        }
+    }
+    if (ticked) Publish();
+    if (!do_tick) {
+        tickAccumulator = tickSeconds; // paused, tick as soon as we're advanced
+        return 100; // commands wake us sooner
+    }
+    return std::ceil((tickSeconds - tickAccumulator) * 1000);
+}
 
+int SimulationMain(void*)
+{
+    Uint32 wait = 0;
+    while (ApplyCommands(wait)) wait = RunDueTicks();
+    return 0;
+}
 
 void mainLoop();
 
 SDL_Renderer* sdlRenderer;
 SDL_Texture* targetTexture;
 
-const int param_rows = 4;
-const int param_cols = 5;
 int param_index = 0;
-float *params[param_rows * param_cols] = { &alignmentRadius, &cohesionRadius, &avoidanceRadius, &flockRadius, &obstacleRadius,
-                                           &alignmentWeight, &cohesionWeight, &avoidanceWeight, &flockWeight, &obstacleWeight,
-                                           &maxSpeed,        &maxAccel,       nullptr,          &dragCoeff,      &edgeObstacle, 
-                                           &minSpeed,        &baseAccel,      nullptr,          nullptr,         nullptr };
 float delta[param_rows * param_cols];
 
 bool running = true;
-bool do_tick = true;
-bool single_tick = false;
 bool follow = false;
 
 int zoom = 0;
 vec2f zoom_pos = {0, 0};
 
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wunused-parameter"
 int main(int argc, char* argv[]) { // args are required for SDL_main
-#pragma GCC diagnostic pop
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if ((arg == "-t" || arg == "--threads") && i + 1 < argc) {
+            threadCount = std::atoi(argv[++i]);
+        } else if ((arg == "-s" || arg == "--seed") && i + 1 < argc) {
+            randomSeed = std::strtoull(argv[++i], nullptr, 0);
+        } else if ((arg == "-b" || arg == "--boids") && i + 1 < argc) {
+            boids.agents.resize(std::atoi(argv[++i]));
+        } else if ((arg == "-f" || arg == "--fish") && i + 1 < argc) {
+            fishes.agents.resize(std::atoi(argv[++i]));
+        } else if (arg == "--skin" && i + 1 < argc) {
+            neighborSkin = std::atof(argv[++i]);
+        } else if (arg == "--nearest" && i + 1 < argc) {
+            nearestCount = std::atoi(argv[++i]);
+        } else if (arg == "--reorder" && i + 1 < argc) {
+            reorderInterval = std::atoi(argv[++i]);
+        } else if (arg == "--aggregate" && i + 1 < argc) {
+            aggregateCell = std::atof(argv[++i]);
+        } else if (arg == "--map" && i + 1 < argc) {
+            mapFile = argv[++i];
+        } else if (arg == "--headless" && i + 1 < argc) {
+            headlessTicks = std::strtoull(argv[++i], nullptr, 0);
+        } else {
+            std::cout << "usage: " << argv[0] << " [-t|--threads count] [-s|--seed seed] [-b|--boids count] [-f|--fish count] [--skin radius] [--nearest count] [--reorder ticks] [--aggregate cell] [--map file] [--headless ticks]\n"
+                         "  -t, --threads  number of simulation threads, 0 for one per cpu (default)\n"
+                         "  -s, --seed     seed for every random draw, runs with the same seed reproduce exactly\n"
+                         "  -b, --boids    number of boids (default 100)\n"
+                         "  -f, --fish     number of fish (default 100)\n"
+                         "      --skin     keep verlet neighbor lists this much wider than the neighbor radius, 0 to search every tick (default)\n"
+                         "      --nearest  interact with only this many nearest neighbors, 0 for every neighbor in range (default)\n"
+                         "      --reorder  ticks between sorting the agents in memory by position, 0 to never sort (default 64)\n"
+                         "      --aggregate sum alignment and cohesion from totals over cells of this size, 0 to sum every neighbor (default)\n"
+                         "      --map      bitmap in res whose bright pixels are obstacles, stretched over the window\n"
+                         "      --headless simulate this many ticks without a window, then print ticks/s and a checksum of the final state" << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
 
     SDL_version compiled;
     SDL_version linked;
@@ -807,6 +1299,21 @@ int main(int argc, char* argv[]) { // args are required for SDL_main
     printf("Linked against SDL version %d.%d.%d\n",
             linked.major, linked.minor, linked.patch);
 
+    if (!mapFile.empty() && !obstacleMap.load(mapFile, WINDOW_WIDTH, WINDOW_HEIGHT)) {
+        logSDLError("LoadBMP");
+        return EXIT_FAILURE;
+    }
+
+    pool.start(threadCount ? threadCount : SDL_GetCPUCount());
+    printf("Simulating on %u threads\n", pool.size());
+
+    if (headlessTicks) {
+        int result = RunHeadless(headlessTicks);
+        pool.stop();
+        SDL_Quit();
+        return result;
+    }
+
     if (SDL_Init(SDL_INIT_VIDEO) != 0) {
         logSDLError("Init");
         return EXIT_FAILURE;
@@ -870,17 +1377,30 @@ int main(int argc, char* argv[]) { // args are required for SDL_main
 
     for (int i = 0; i < param_rows * param_cols; i++) {
         if (params[i] != nullptr) delta[i] = *params[i] * .05f; // adjust by 5% of initial value
+        if (params[i] == &neighborSkin) delta[i] = 5; // starts off at 0
+        if (params[i] == &nearestCount) delta[i] = 1;
     }
 
-    InitBoids(boids);
-    InitFish(fishes);
+    InitSpecies(boids);
+    InitSpecies(fishes);
+    Publish();
 
     #if __EMSCRIPTEN__
     emscripten_set_main_loop(mainLoop, 0, true);
     #else
+    SDL_Thread* simulation = SDL_CreateThread(SimulationMain, "boids simulation", nullptr);
+    if (simulation == nullptr) {
+        logSDLError("CreateThread");
+        cleanup(sdlRenderer, window, targetTexture);
+        SDL_Quit();
+        return EXIT_FAILURE;
+    }
     while (running) mainLoop();
+    commands.send({ COMMAND_QUIT, 0, 0 });
+    SDL_WaitThread(simulation, nullptr);
     #endif
 
+    pool.stop();
     cleanup(sdlRenderer, window, targetTexture);
     SDL_Quit();
     return 0;
@@ -889,11 +1409,19 @@ int main(int argc, char* argv[]) { // args are required for SDL_main
 
 void mainLoop()
 {
-    if (do_tick) {
-        UpdateBoids();
-        UpdateFish(fishes);
-        if (single_tick) { do_tick = false; }
-    }
+    scoped_timer frame_timer(profile[PROFILE_FRAME]);
+
+    #if __EMSCRIPTEN__ // the web build has no threads, simulate between frames instead
+    ApplyCommands(0);
+    RunDueTicks();
+    #endif
+
+    snapshots.acquire();
+    const world_snapshot& snapshot = snapshots.read();
+
+    // how far the frame is between the previous tick and the current one, which stays on screen once the ticks stop
+    const double since_tick = double(SDL_GetPerformanceCounter() - snapshot.time) / SDL_GetPerformanceFrequency();
+    const float alpha = std::min(since_tick / tickSeconds, 1.);
 
     // Draw to the target texture
     SDL_SetRenderTarget(sdlRenderer, targetTexture);
@@ -913,32 +1441,43 @@ void mainLoop()
     SDL_FRect water = { 0, WINDOW_HEIGHT - waterHeight, WINDOW_WIDTH, waterHeight };
     SDL_SetRenderDrawColor(sdlRenderer, COLOR_WATER, SDL_ALPHA_OPAQUE);
     SDL_RenderFillRectF(sdlRenderer, &water);
+
+    // Draw map obstacles
+    SDL_SetRenderDrawColor(sdlRenderer, COLOR_GROUND, SDL_ALPHA_OPAQUE);
+    SDL_RenderFillRectsF(sdlRenderer, obstacleMap.rects.data(), obstacleMap.rects.size());
     }
 
     // Draw boids
-    RenderBoids(boids, sdlRenderer);
-    RenderFish(fishes, sdlRenderer);
+    {
+        scoped_timer timer(profile[PROFILE_RENDER_BOIDS]);
+        RenderSpecies(snapshot.boids, snapshot, alpha, sdlRenderer);
+    }
+    {
+        scoped_timer timer(profile[PROFILE_RENDER_FISH]);
+        RenderSpecies(snapshot.fishes, snapshot, alpha, sdlRenderer);
+    }
 
     #if !__EMSCRIPTEN__ // don't display debug parameters in web
 
     if(DEBUG_ENABLE) {
+        scoped_timer timer(profile[PROFILE_HUD]);
         #define STRINGIZE(S) #S
         #define STRING(S) STRINGIZE(S)
         #define PARAM_WIDTH 10
         #define PARAM_FMT " %" STRING(PARAM_WIDTH) "f"
         // Render parameters
         RenderMessage(sdlRenderer, 5, 5, string_format(
-            "Use arrow keys and +/- to edit parameters. Press ~ to toggle debug display, R to reset all boids. A to toggle single step, space to advance\n" 
+            "Use arrow keys and +/- to edit parameters. Press ~ to toggle debug display, V to show the forces on every agent, R to reset all boids. A to toggle single step, space to advance\n" 
             "        ALIGNMENT   COHESION  AVOIDANCE   FLOCK  OBSTACLE\n"
             "RADIUS" PARAM_FMT PARAM_FMT PARAM_FMT PARAM_FMT PARAM_FMT "\n"
             "WEIGHT" PARAM_FMT PARAM_FMT PARAM_FMT PARAM_FMT PARAM_FMT "\n"
-            "            SPEED      ACCEL              DRAG          EDGE\n"
-            "   MAX" PARAM_FMT PARAM_FMT "           " PARAM_FMT PARAM_FMT "\n"
-            "   MIN" PARAM_FMT PARAM_FMT "\n",
-            alignmentRadius, cohesionRadius, avoidanceRadius, flockRadius, obstacleRadius,
-            alignmentWeight, cohesionWeight, avoidanceWeight, flockWeight, obstacleWeight,
-            maxSpeed, maxAccel, dragCoeff, edgeObstacle,
-            minSpeed, baseAccel
+            "            SPEED      ACCEL  SKIN/NEAR   DRAG          EDGE\n"
+            "   MAX" PARAM_FMT PARAM_FMT PARAM_FMT PARAM_FMT PARAM_FMT "\n"
+            "   MIN" PARAM_FMT PARAM_FMT PARAM_FMT "\n",
+            snapshot.value(alignmentRadius), snapshot.value(cohesionRadius), snapshot.value(avoidanceRadius), snapshot.value(flockRadius), snapshot.value(obstacleRadius),
+            snapshot.value(alignmentWeight), snapshot.value(cohesionWeight), snapshot.value(avoidanceWeight), snapshot.value(flockWeight), snapshot.value(obstacleWeight),
+            snapshot.value(maxSpeed), snapshot.value(maxAccel), snapshot.value(neighborSkin), snapshot.value(dragCoeff), snapshot.value(edgeObstacle),
+            snapshot.value(minSpeed), snapshot.value(baseAccel), snapshot.value(nearestCount)
         ));
     
         SDL_Rect cursor = { (11 + (param_index % param_cols) * (PARAM_WIDTH+1)) * font_width,
@@ -947,15 +1486,19 @@ void mainLoop()
                             font_height };
         SDL_SetRenderDrawColor(sdlRenderer, COLOR_CURSOR, 255);
         SDL_RenderDrawRect(sdlRenderer, &cursor);
+
+        // Render neighbor list stats and timings, from the ticks and frames before this one
+        RenderMessage(sdlRenderer, 5, 14, snapshot.report + profile_report(profile + PROFILE_FRAME, PROFILE_COUNT - PROFILE_FRAME));
     }
     #endif
 
     SDL_SetRenderTarget(sdlRenderer, nullptr);
     const float zoom_sens = 0.25f;
     float zoom_mul = std::pow(2.f, -zoom * zoom_sens);
-    if (follow) {
-        zoom_pos.x = boids[0].pos.x - WINDOW_WIDTH * zoom_mul / 2;
-        zoom_pos.y = boids[0].pos.y - WINDOW_HEIGHT * zoom_mul / 2;
+    if (follow && snapshot.boids.size()) {
+        const vec2f followed{ snapshot.boids.x[snapshot.boids.followed], snapshot.boids.y[snapshot.boids.followed] };
+        zoom_pos.x = followed.x - WINDOW_WIDTH * zoom_mul / 2;
+        zoom_pos.y = followed.y - WINDOW_HEIGHT * zoom_mul / 2;
         zoom_pos.y = clamp(zoom_pos.y, 0.f, WINDOW_HEIGHT * (1 - zoom_mul));
         zoom_pos.x = clamp(zoom_pos.x, 0.f, WINDOW_WIDTH * (1 - zoom_mul));
     }
@@ -966,8 +1509,11 @@ void mainLoop()
                              static_cast<int>(WINDOW_HEIGHT * zoom_mul) };
     
 
-    SDL_RenderCopy(sdlRenderer, targetTexture, &zoom_window, nullptr);
-    SDL_RenderPresent(sdlRenderer);
+    {
+        scoped_timer timer(profile[PROFILE_PRESENT]);
+        SDL_RenderCopy(sdlRenderer, targetTexture, &zoom_window, nullptr);
+        SDL_RenderPresent(sdlRenderer);
+    }
 
     // process events
     #if !__EMSCRIPTEN__  // don't process events for the debug screen when running in web
@@ -982,7 +1528,7 @@ void mainLoop()
         case SDL_KEYDOWN:
             switch (ev.key.keysym.sym) {
             
-            case SDLK_BACKQUOTE: DEBUG_ENABLE = (DEBUG_ENABLE + 1) % 3; break;
+            case SDLK_BACKQUOTE: DEBUG_ENABLE = (DEBUG_ENABLE + 1) % 3; commands.send({ COMMAND_DEBUG, 0, float(DEBUG_ENABLE) }); break;
             
             case SDLK_UP:    if ((next_param = param_index - param_cols) >= 0                            && params[next_param] != nullptr) param_index = next_param; break;
             case SDLK_DOWN:  if ((next_param = param_index + param_cols) < (param_cols * param_rows - 1) && params[next_param] != nullptr) param_index = next_param; break;
@@ -990,13 +1536,14 @@ void mainLoop()
             case SDLK_RIGHT: if ((next_param = param_index + 1) < (param_cols * param_rows - 1)          && params[next_param] != nullptr) param_index = next_param; break;
             
             case SDLK_EQUALS:
-            case SDLK_PLUS:  *params[param_index] += delta[param_index]; break;
-            case SDLK_MINUS: *params[param_index] -= delta[param_index]; break;
+            case SDLK_PLUS:  commands.send({ COMMAND_ADJUST, param_index, delta[param_index] }); break;
+            case SDLK_MINUS: commands.send({ COMMAND_ADJUST, param_index, -delta[param_index] }); break;
             
-            case SDLK_r: InitBoids(boids); InitFish(fishes); break;
-            case SDLK_a: single_tick = !single_tick; break;
+            case SDLK_r: commands.send({ COMMAND_RESET, 0, 0 }); break;
+            case SDLK_a: commands.send({ COMMAND_SINGLE_TICK, 0, 0 }); break;
             case SDLK_f: follow = !follow; break;
-            case SDLK_SPACE: do_tick = true; break;
+            case SDLK_v: debugAllAgents = !debugAllAgents; break;
+            case SDLK_SPACE: commands.send({ COMMAND_ADVANCE, 0, 0 }); break;
             }
             break;
         case SDL_MOUSEWHEEL: {
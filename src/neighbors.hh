@@ -0,0 +1,493 @@
+#ifndef NEIGHBORS_HH
+#define NEIGHBORS_HH
+
+#include <vector>
+#include <cstddef>
+#include <algorithm>
+
+#include "vec2.hh"
+#include "flock.hh"
+#include "grid.hh"
+#include "simd.hh"
+#include "pool.hh"
+#include "kdtree.hh"
+
+/**
+ * The neighbors of every agent in one tick, in compressed sparse row layout.
+ * The neighbors of agent i are entries start[i] .. start[i + 1], each one the
+ * position of the neighbor in the grid ordered cells and its squared distance.
+ * It is searched once per tick, and every pass that needs neighbors reads it
+ * instead of querying the grid again.
+ */
+struct neighbor_list {
+    std::vector<unsigned> start; // agent count + 1 offsets into cell and dist2
+    std::vector<unsigned> cell;  // neighbor positions in the cells
+    std::vector<float> dist2;    // squared distance to each neighbor
+
+    // the agents are searched in blocks, each into its own buffers, so blocks can run in parallel
+    static const std::size_t block_size = 64;
+    struct block {
+        std::vector<unsigned> cell;
+        std::vector<float> dist2;
+        std::size_t base; // offset of the block in the list
+    };
+    std::vector<block> blocks;
+
+    /** @return the number of agents in the list */
+    std::size_t size() const { return start.empty() ? 0 : start.size() - 1; }
+
+    /**
+     * Refill the list for count agents, calling search(i, cell, dist2) to append
+     * the neighbors of agent i. Agents are searched in parallel blocks
+     */
+    template <typename F>
+    void fill(thread_pool& pool, std::size_t count, F search)
+    {
+        start.resize(count + 1);
+        start[0] = 0;
+        blocks.resize((count + block_size - 1) / block_size);
+
+        // start[i + 1] holds the end of agent i within its block until the blocks are joined
+        pool.parallel_for(blocks.size(), [&](std::size_t begin, std::size_t end) {
+            for (std::size_t b = begin; b < end; b++) {
+                block& blk = blocks[b];
+                blk.cell.clear();
+                blk.dist2.clear();
+                for (std::size_t i = b * block_size; i < std::min(count, (b + 1) * block_size); i++) {
+                    search(i, blk.cell, blk.dist2);
+                    start[i + 1] = blk.cell.size();
+                }
+            }
+        }, 1);
+
+        std::size_t total = 0;
+        for (std::size_t b = 0; b < blocks.size(); b++) {
+            blocks[b].base = total;
+            total += blocks[b].cell.size();
+        }
+        cell.resize(total);
+        dist2.resize(total);
+
+        pool.parallel_for(blocks.size(), [&](std::size_t begin, std::size_t end) {
+            for (std::size_t b = begin; b < end; b++) {
+                const block& blk = blocks[b];
+                std::copy(blk.cell.begin(), blk.cell.end(), cell.begin() + blk.base);
+                std::copy(blk.dist2.begin(), blk.dist2.end(), dist2.begin() + blk.base);
+                for (std::size_t i = b * block_size; i < std::min(count, (b + 1) * block_size); i++) start[i + 1] += blk.base;
+            }
+        }, 1);
+    }
+
+    /**
+     * Search the grid for the neighbors within radius of every agent accepted by include,
+     * agents that aren't accepted get no neighbors
+     */
+    template <typename Agent, typename Pred>
+    void build(thread_pool& pool, const flock<Agent>& agents, const spatial_grid& grid, const flock<Agent>& cells, float radius, Pred include)
+    {
+        const search_data data = { cells.x.data(), cells.y.data(), grid.items.data() };
+        fill(pool, agents.size(), [&](std::size_t i, std::vector<unsigned>& found, std::vector<float>& dist2) {
+            if (!include(i)) return;
+            const search_query query = { agents.pos(i), static_cast<unsigned>(i), radius * radius };
+            grid.query_ranges(query.pos, radius, [&](unsigned first, unsigned last) {
+                search_neighbors(query, data, first, last, found, dist2);
+            });
+        });
+    }
+
+    /**
+     * Find the (at most) k nearest neighbors within radius of every agent accepted by include,
+     * nearest first. tree holds the positions of the cells, items are the agents in the cells
+     */
+    template <typename Agent, typename Pred>
+    void build_nearest(thread_pool& pool, const flock<Agent>& agents, const kd_tree& tree, const std::vector<unsigned>& items, unsigned k, float radius, Pred include)
+    {
+        fill(pool, agents.size(), [&](std::size_t i, std::vector<unsigned>& found, std::vector<float>& dist2) {
+            if (!include(i)) return;
+            tree.nearest(agents.pos(i), k, radius, [&](unsigned cell) { return items[cell] == i; }, found, dist2);
+        });
+    }
+};
+
+/**
+ * Verlet neighbor lists: every agent keeps a list of candidates within radius + skin,
+ * and each tick only those candidates are checked for the neighbors within radius.
+ * Candidates are searched again once some agent has moved more than skin / 2 since
+ * the last search, before that no two agents can have closed in by more than skin,
+ * so no neighbor is ever missed. The grid order is kept between searches, the cells
+ * are only refreshed from the agents every tick.
+ */
+struct verlet_list {
+    neighbor_list candidates;      // positions in the cells, in the order of the last search
+    std::vector<float> x0, y0;     // positions at the last search
+    std::vector<bool> searched;    // agents that got candidates at the last search
+    float radius = 0, skin = 0;    // what the candidates were searched with
+    unsigned long long ticks = 0;    // ticks since the radius or skin last changed
+    unsigned long long searches = 0; // searches since then
+
+    /** forget the candidates, for when the grid was rebuilt by someone else */
+    void reset() { x0.clear(); }
+
+    /** @return true if the candidates no longer cover every neighbor within radius of the included agents */
+    template <typename Agent, typename Pred>
+    bool stale(const flock<Agent>& agents, float radius, float skin, Pred include) const
+    {
+        if (radius != this->radius || skin != this->skin || agents.size() != x0.size()) return true;
+        const float limit = skin * skin / 4;
+        for (std::size_t i = 0; i < agents.size(); i++) {
+            if (dist_squared(agents.pos(i), { x0[i], y0[i] }) > limit) return true;
+            if (!searched[i] && include(i)) return true;
+        }
+        return false;
+    }
+
+    /**
+     * Find the neighbors within radius of every agent accepted by include, among its candidates.
+     * Neighbors that include doesn't accept are left out. grid must have been sized for the radius
+     */
+    template <typename Agent, typename Pred>
+    void update(thread_pool& pool, const flock<Agent>& agents, spatial_grid& grid, flock<Agent>& cells, float radius, float skin, Pred include, neighbor_list& out)
+    {
+        if (radius != this->radius || skin != this->skin) ticks = searches = 0;
+        ticks++;
+
+        if (stale(agents, radius, skin, include)) {
+            // every agent is gridded, agents that aren't included now may be by the next tick
+            grid.build(agents.size(), [&](std::size_t i) { return agents.pos(i); }, [](std::size_t) { return true; });
+            cells.gather(agents, grid.items);
+            candidates.build(pool, agents, grid, cells, radius + skin, include);
+            x0 = agents.x;
+            y0 = agents.y;
+            searched.resize(agents.size());
+            for (std::size_t i = 0; i < agents.size(); i++) searched[i] = include(i);
+            this->radius = radius;
+            this->skin = skin;
+            searches++;
+        } else {
+            cells.gather(agents, grid.items);
+        }
+
+        const float r2 = radius * radius;
+        out.fill(pool, agents.size(), [&](std::size_t i, std::vector<unsigned>& found, std::vector<float>& dist2) {
+            if (!include(i)) return;
+            const vec2f pos = agents.pos(i);
+            for (unsigned e = candidates.start[i]; e < candidates.start[i + 1]; e++) {
+                const unsigned k = candidates.cell[e];
+                const float d2 = dist_squared(pos, cells.pos(k));
+                if (d2 <= r2 && include(grid.items[k])) {
+                    found.push_back(k);
+                    dist2.push_back(d2);
+                }
+            }
+        });
+    }
+};
+
+/**
+ * bits for the parts of the per-neighbor loop an acceleration kernel is compiled with. only the terms
+ * that change that loop get kernels of their own, the others are skipped per agent when their weight is zero
+ */
+enum force_term : unsigned {
+    TERM_LISTED    = 1 << 0, // alignment and cohesion summed over the list, rather than from the aggregate totals
+    TERM_AVOIDANCE = 1 << 1,
+    TERM_ALL       = (1 << 2) - 1,
+};
+
+/** the agent whose neighbor terms are summed, and the squared radii of each behavior, negative to sum nothing */
+struct neighbor_query {
+    vec2f pos, vel;
+    bool leader;
+    float alignment_r2, cohesion_r2, avoidance_r, avoidance_r2, flock_r2;
+};
+
+struct neighbor_sums {
+    vec2f alignment{ 0, 0 }, cohesion{ 0, 0 }, avoidance{ 0, 0 };
+    int alignment_count = 0, cohesion_count = 0, avoidance_count = 0;
+};
+
+/** add the terms of the listed neighbors at entries [begin, end) of the list one at a time */
+template <unsigned Terms, typename Agent, typename F>
+void accumulate_scalar(const neighbor_query& q, const flock<Agent>& cells, const neighbor_list& list, unsigned begin, unsigned end, neighbor_sums& s, F on_leader)
+{
+    for (unsigned e = begin; e < end; e++)
+    {
+        const unsigned k = list.cell[e];
+        const float d2 = list.dist2[e];
+        const vec2f g_pos = cells.pos(k);
+        const unsigned g_flags = cells.flags[k];
+
+        if ((Terms & TERM_LISTED) && d2 <= q.alignment_r2) {
+            s.alignment += cells.vel(k) - q.vel;
+            s.alignment_count++;
+        }
+        if ((Terms & TERM_LISTED) && d2 <= q.cohesion_r2) {
+            s.cohesion += g_pos - q.pos;
+            s.cohesion_count++;
+        }
+        if ((Terms & TERM_AVOIDANCE) && d2 <= q.avoidance_r2) {
+            if (q.leader && !(g_flags & FLAG_LEADER)) { // let leaders pass to the front
+                s.avoidance += normal(q.vel) * (q.avoidance_r - mag(q.pos - g_pos));
+            } else {
+                s.avoidance += normal(q.pos - g_pos) * (q.avoidance_r - mag(q.pos - g_pos));
+            }
+            s.avoidance_count++;
+        }
+        if (d2 <= q.flock_r2 && (g_flags & FLAG_LEADER)) on_leader(k);
+    }
+}
+
+#if SIMD_X86
+
+/*
+ * The vector kernels take the listed neighbors 4 (SSE2) or 8 (AVX2) at a time, gathering
+ * their fields from the cells by index, and sum each term with a mask of the lanes in its
+ * radius. They use the same float operations as the scalar loop (no fma, correctly rounded
+ * sqrt and division) but sum in a different order, the AVX2 kernel also scales the sum of
+ * the leader passing weights by normal(vel) once instead of per neighbor. The sums match
+ * the scalar kernel to within 1e-5 of the summed magnitude, the counts are exact. Leaders in
+ * the flock radius are handed to on_leader one by one in list order, so the branchy leader
+ * following stays scalar.
+ */
+
+/** @return the four floats at p[k[0]] .. p[k[3]], sse2 has no gather */
+inline __m128 gather_sse2(const float* p, const unsigned* k) { return _mm_setr_ps(p[k[0]], p[k[1]], p[k[2]], p[k[3]]); }
+
+/** add the lanes of x and y to v */
+inline void add_lanes(vec2f& v, __m128 x, __m128 y)
+{
+    float lx[4], ly[4];
+    _mm_storeu_ps(lx, x);
+    _mm_storeu_ps(ly, y);
+    v += vec2f{ lx[0] + lx[1] + lx[2] + lx[3], ly[0] + ly[1] + ly[2] + ly[3] };
+}
+
+template <unsigned Terms, typename Agent, typename F>
+void accumulate_sse2(const neighbor_query& q, const flock<Agent>& cells, const neighbor_list& list, std::size_t i, neighbor_sums& s, F on_leader)
+{
+    const __m128 px = _mm_set1_ps(q.pos.x), py = _mm_set1_ps(q.pos.y);
+    const __m128 vx = _mm_set1_ps(q.vel.x), vy = _mm_set1_ps(q.vel.y);
+    const __m128 a_r2 = _mm_set1_ps(q.alignment_r2), c_r2 = _mm_set1_ps(q.cohesion_r2);
+    const __m128 v_r = _mm_set1_ps(q.avoidance_r), v_r2 = _mm_set1_ps(q.avoidance_r2), f_r2 = _mm_set1_ps(q.flock_r2);
+    const vec2f nv = normal(q.vel);
+    const __m128 nvx = _mm_set1_ps(nv.x), nvy = _mm_set1_ps(nv.y);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128i leader = _mm_set1_epi32(FLAG_LEADER), izero = _mm_setzero_si128();
+    const __m128 q_leader = _mm_castsi128_ps(_mm_set1_epi32(q.leader ? -1 : 0));
+
+    __m128 ax = zero, ay = zero, cx = zero, cy = zero, vsx = zero, vsy = zero;
+
+    unsigned e = list.start[i];
+    const unsigned end = list.start[i + 1];
+    for (; e + 4 <= end; e += 4)
+    {
+        const unsigned* k = list.cell.data() + e;
+        const __m128 d2 = _mm_loadu_ps(list.dist2.data() + e);
+        const __m128 gx = gather_sse2(cells.x.data(), k), gy = gather_sse2(cells.y.data(), k);
+        const __m128i gf = _mm_setr_epi32(cells.flags[k[0]], cells.flags[k[1]], cells.flags[k[2]], cells.flags[k[3]]);
+        const __m128 ox = _mm_sub_ps(gx, px), oy = _mm_sub_ps(gy, py); // g - b
+
+        if (Terms & TERM_LISTED) {
+            const __m128 in_a = _mm_cmple_ps(d2, a_r2);
+            if (const int a_bits = _mm_movemask_ps(in_a)) {
+                ax = _mm_add_ps(ax, _mm_and_ps(in_a, _mm_sub_ps(gather_sse2(cells.vx.data(), k), vx)));
+                ay = _mm_add_ps(ay, _mm_and_ps(in_a, _mm_sub_ps(gather_sse2(cells.vy.data(), k), vy)));
+                s.alignment_count += __builtin_popcount(a_bits);
+            }
+            const __m128 in_c = _mm_cmple_ps(d2, c_r2);
+            cx = _mm_add_ps(cx, _mm_and_ps(in_c, ox));
+            cy = _mm_add_ps(cy, _mm_and_ps(in_c, oy));
+            s.cohesion_count += __builtin_popcount(_mm_movemask_ps(in_c));
+        }
+        if (Terms & TERM_AVOIDANCE) {
+            const __m128 in_v = _mm_cmple_ps(d2, v_r2);
+            if (const int v_bits = _mm_movemask_ps(in_v)) {
+                const __m128 g_leader = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(gf, leader), izero)); // g is not a leader
+                const __m128 pass = _mm_and_ps(q_leader, g_leader);
+                const __m128 m = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(ox, ox), _mm_mul_ps(oy, oy)));
+                const __m128 w = _mm_sub_ps(v_r, m);
+                const __m128 nonzero = _mm_cmpneq_ps(m, zero);
+                const __m128 ax_away = _mm_and_ps(nonzero, _mm_mul_ps(_mm_div_ps(_mm_sub_ps(zero, ox), m), w));
+                const __m128 ay_away = _mm_and_ps(nonzero, _mm_mul_ps(_mm_div_ps(_mm_sub_ps(zero, oy), m), w));
+                const __m128 tx = _mm_or_ps(_mm_and_ps(pass, _mm_mul_ps(nvx, w)), _mm_andnot_ps(pass, ax_away));
+                const __m128 ty = _mm_or_ps(_mm_and_ps(pass, _mm_mul_ps(nvy, w)), _mm_andnot_ps(pass, ay_away));
+                vsx = _mm_add_ps(vsx, _mm_and_ps(in_v, tx));
+                vsy = _mm_add_ps(vsy, _mm_and_ps(in_v, ty));
+                s.avoidance_count += __builtin_popcount(v_bits);
+            }
+        }
+        const __m128 is_leader = _mm_castsi128_ps(_mm_cmpgt_epi32(_mm_and_si128(gf, leader), izero));
+        int f_bits = _mm_movemask_ps(_mm_and_ps(is_leader, _mm_cmple_ps(d2, f_r2)));
+        while (f_bits) {
+            on_leader(k[__builtin_ctz(f_bits)]);
+            f_bits &= f_bits - 1;
+        }
+    }
+
+    add_lanes(s.alignment, ax, ay);
+    add_lanes(s.cohesion, cx, cy);
+    add_lanes(s.avoidance, vsx, vsy);
+
+    accumulate_scalar<Terms>(q, cells, list, e, end, s, on_leader);
+}
+
+#if SIMD_AVX2_KERNELS
+
+/*
+ * NOTE: mingw-w64 does not realign the stack for spilled 32 byte values (gcc bug 54412), so nothing
+ * in the avx2 kernel may be spilled. Its work is split into passes over the list that each keep few
+ * enough values live to stay in the 16 ymm registers, and that aren't inlined, so no vector outlives
+ * its pass. Leaders are noted per block of 8 by the last pass, a chunk of blocks at a time, and
+ * handed to on_leader between chunks, while no vectors are live.
+ */
+
+/** the fields of the cells the avx2 passes gather from */
+struct gather_fields {
+    const float *x, *y, *vx, *vy;
+    const int* flags;
+    const unsigned* cell; // the listed neighbors
+    const float* dist2;
+};
+
+/** @return the 8 lanes of v folded to 4, to be summed like the sse2 kernel's */
+__attribute__((target("avx2")))
+inline __m128 fold_avx2(__m256 v) { return _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1)); }
+
+__attribute__((target("avx2"), noinline))
+void alignment_avx2(const neighbor_query& q, const gather_fields& g, unsigned begin, unsigned end, neighbor_sums& s)
+{
+    const __m256 vx = _mm256_set1_ps(q.vel.x), vy = _mm256_set1_ps(q.vel.y), a_r2 = _mm256_set1_ps(q.alignment_r2);
+    __m256 ax = _mm256_setzero_ps(), ay = ax;
+    for (unsigned e = begin; e < end; e += 8)
+    {
+        const __m256 in_a = _mm256_cmp_ps(_mm256_loadu_ps(g.dist2 + e), a_r2, _CMP_LE_OQ);
+        if (const int a_bits = _mm256_movemask_ps(in_a)) {
+            const __m256i k = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(g.cell + e));
+            ax = _mm256_add_ps(ax, _mm256_and_ps(in_a, _mm256_sub_ps(_mm256_i32gather_ps(g.vx, k, 4), vx)));
+            ay = _mm256_add_ps(ay, _mm256_and_ps(in_a, _mm256_sub_ps(_mm256_i32gather_ps(g.vy, k, 4), vy)));
+            s.alignment_count += __builtin_popcount(a_bits);
+        }
+    }
+    add_lanes(s.alignment, fold_avx2(ax), fold_avx2(ay));
+}
+
+__attribute__((target("avx2"), noinline))
+void cohesion_avx2(const neighbor_query& q, const gather_fields& g, unsigned begin, unsigned end, neighbor_sums& s)
+{
+    const __m256 px = _mm256_set1_ps(q.pos.x), py = _mm256_set1_ps(q.pos.y), c_r2 = _mm256_set1_ps(q.cohesion_r2);
+    __m256 cx = _mm256_setzero_ps(), cy = cx;
+    for (unsigned e = begin; e < end; e += 8)
+    {
+        const __m256 in_c = _mm256_cmp_ps(_mm256_loadu_ps(g.dist2 + e), c_r2, _CMP_LE_OQ);
+        if (const int c_bits = _mm256_movemask_ps(in_c)) {
+            const __m256i k = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(g.cell + e));
+            cx = _mm256_add_ps(cx, _mm256_and_ps(in_c, _mm256_sub_ps(_mm256_i32gather_ps(g.x, k, 4), px)));
+            cy = _mm256_add_ps(cy, _mm256_and_ps(in_c, _mm256_sub_ps(_mm256_i32gather_ps(g.y, k, 4), py)));
+            s.cohesion_count += __builtin_popcount(c_bits);
+        }
+    }
+    add_lanes(s.cohesion, fold_avx2(cx), fold_avx2(cy));
+}
+
+__attribute__((target("avx2"), noinline))
+void avoidance_avx2(const neighbor_query& q, const gather_fields& g, unsigned begin, unsigned end, neighbor_sums& s)
+{
+    const __m256 px = _mm256_set1_ps(q.pos.x), py = _mm256_set1_ps(q.pos.y);
+    const __m256 v_r = _mm256_set1_ps(q.avoidance_r), v_r2 = _mm256_set1_ps(q.avoidance_r2);
+    __m256 vsx = _mm256_setzero_ps(), vsy = vsx, vsw = vsx; // vsw sums the weights of the neighbors a leader passes
+    for (unsigned e = begin; e < end; e += 8)
+    {
+        const __m256 in_v = _mm256_cmp_ps(_mm256_loadu_ps(g.dist2 + e), v_r2, _CMP_LE_OQ);
+        if (const int v_bits = _mm256_movemask_ps(in_v)) {
+            const __m256i k = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(g.cell + e));
+            __m256 pass = _mm256_setzero_ps();
+            if (q.leader) { // let leaders pass to the front of the neighbors that aren't leaders
+                const __m256i gf = _mm256_slli_epi32(_mm256_i32gather_epi32(g.flags, k, 4), 31 - __builtin_ctz(FLAG_LEADER)); // the leader bit as the sign
+                pass = _mm256_andnot_ps(_mm256_castsi256_ps(_mm256_srai_epi32(gf, 31)), in_v);
+            }
+            const __m256 ox = _mm256_sub_ps(_mm256_i32gather_ps(g.x, k, 4), px); // g - b
+            const __m256 oy = _mm256_sub_ps(_mm256_i32gather_ps(g.y, k, 4), py);
+            const __m256 m = _mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(ox, ox), _mm256_mul_ps(oy, oy)));
+            const __m256 w = _mm256_sub_ps(v_r, m);
+            const __m256 away = _mm256_andnot_ps(pass, _mm256_and_ps(in_v, _mm256_cmp_ps(m, _mm256_setzero_ps(), _CMP_NEQ_UQ)));
+            vsx = _mm256_sub_ps(vsx, _mm256_and_ps(away, _mm256_mul_ps(_mm256_div_ps(ox, m), w)));
+            vsy = _mm256_sub_ps(vsy, _mm256_and_ps(away, _mm256_mul_ps(_mm256_div_ps(oy, m), w)));
+            vsw = _mm256_add_ps(vsw, _mm256_and_ps(pass, w));
+            s.avoidance_count += __builtin_popcount(v_bits);
+        }
+    }
+    add_lanes(s.avoidance, fold_avx2(vsx), fold_avx2(vsy));
+    vec2f passed{ 0, 0 };
+    add_lanes(passed, fold_avx2(vsw), _mm_setzero_ps());
+    s.avoidance += normal(q.vel) * passed.x;
+}
+
+/** note the lanes of each block of 8 from begin to end that hold a leader within the flock radius */
+__attribute__((target("avx2"), noinline))
+void leaders_avx2(const neighbor_query& q, const gather_fields& g, unsigned begin, unsigned end, unsigned char* leaders)
+{
+    const __m256 f_r2 = _mm256_set1_ps(q.flock_r2);
+    const __m256i leader = _mm256_set1_epi32(FLAG_LEADER);
+    for (unsigned e = begin; e < end; e += 8, leaders++)
+    {
+        *leaders = _mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(g.dist2 + e), f_r2, _CMP_LE_OQ));
+        if (*leaders) {
+            const __m256i k = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(g.cell + e));
+            const __m256i gf = _mm256_and_si256(_mm256_i32gather_epi32(g.flags, k, 4), leader);
+            *leaders &= _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(gf, leader)));
+        }
+    }
+}
+
+template <unsigned Terms, typename Agent, typename F>
+void accumulate_avx2(const neighbor_query& q, const flock<Agent>& cells, const neighbor_list& list, std::size_t i, neighbor_sums& s, F on_leader)
+{
+    const gather_fields g = { cells.x.data(), cells.y.data(), cells.vx.data(), cells.vy.data(),
+                              reinterpret_cast<const int*>(cells.flags.data()), list.cell.data(), list.dist2.data() };
+    const unsigned begin = list.start[i], end = list.start[i + 1];
+    const unsigned blocks_end = begin + (end - begin) / 8 * 8;
+
+    if (Terms & TERM_LISTED) {
+        alignment_avx2(q, g, begin, blocks_end, s);
+        cohesion_avx2(q, g, begin, blocks_end, s);
+    }
+    if (Terms & TERM_AVOIDANCE) avoidance_avx2(q, g, begin, blocks_end, s);
+    if (q.flock_r2 >= 0) {
+        const unsigned chunk = 32; // blocks of 8
+        unsigned char leaders[chunk];
+        for (unsigned e = begin; e < blocks_end; e += 8 * chunk) {
+            const unsigned e_end = std::min(blocks_end, e + 8 * chunk);
+            leaders_avx2(q, g, e, e_end, leaders);
+            for (unsigned b = 0; b < (e_end - e) / 8; b++) {
+                for (int f_bits = leaders[b]; f_bits; f_bits &= f_bits - 1) on_leader(g.cell[e + 8 * b + __builtin_ctz(f_bits)]);
+            }
+        }
+    }
+
+    accumulate_scalar<Terms>(q, cells, list, blocks_end, end, s, on_leader);
+}
+
+#endif
+
+#endif
+
+/**
+ * Add the alignment, cohesion and avoidance terms of the listed neighbors of agent i
+ * to the sums, using the widest kernel selected by simd_support. on_leader(k) is called
+ * for each leader within the flock radius. Alignment and cohesion are only summed with
+ * TERM_LISTED in Terms and avoidance with TERM_AVOIDANCE, the others are compiled out.
+ */
+template <unsigned Terms = TERM_ALL, typename Agent, typename F>
+void accumulate_neighbors(const neighbor_query& q, const flock<Agent>& cells, const neighbor_list& list, std::size_t i, neighbor_sums& s, F on_leader)
+{
+    switch (simd_support) {
+        #if SIMD_AVX2_KERNELS
+        case SIMD_AVX2: accumulate_avx2<Terms>(q, cells, list, i, s, on_leader); break;
+        #endif
+        #if SIMD_X86
+        case SIMD_SSE2: accumulate_sse2<Terms>(q, cells, list, i, s, on_leader); break;
+        #endif
+        default: accumulate_scalar<Terms>(q, cells, list, list.start[i], list.start[i + 1], s, on_leader); break;
+    }
+}
+
+#endif
@@ -0,0 +1,208 @@
+#ifndef OBSTACLES_HH
+#define OBSTACLES_HH
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <cstring>
+#include <SDL2/SDL.h>
+
+#include "vec2.hh"
+#include "resource.hh"
+#include "field.hh"
+
+/** obstacles drawn into a bitmap: its bright pixels are solid, and it is stretched over a width by height area */
+struct obstacle_map {
+    unsigned cols = 0, rows = 0;
+    float width = 0, height = 0;
+    std::vector<unsigned char> solid; // one per pixel, row by row
+    std::vector<SDL_FRect> rects;     // the solid runs of each row, stretched, for drawing
+
+    /** @return false if the bitmap couldn't be loaded */
+    bool load(const std::string& file, float width, float height)
+    {
+        SDL_Surface* surface = loadSurface(file);
+        if (surface == nullptr) return false;
+
+        cols = surface->w;
+        rows = surface->h;
+        this->width = width;
+        this->height = height;
+        solid.assign(std::size_t(cols) * rows, 0);
+        SDL_LockSurface(surface);
+        const unsigned bytes = surface->format->BytesPerPixel;
+        for (unsigned r = 0; r < rows; r++) {
+            const Uint8* row = static_cast<const Uint8*>(surface->pixels) + r * surface->pitch;
+            for (unsigned c = 0; c < cols; c++) {
+                Uint32 pixel = 0;
+                std::memcpy(&pixel, row + c * bytes, bytes);
+                Uint8 red, green, blue;
+                SDL_GetRGB(pixel, surface->format, &red, &green, &blue);
+                solid[r * cols + c] = red + green + blue >= 3 * 128;
+            }
+        }
+        SDL_UnlockSurface(surface);
+        cleanup(surface);
+
+        rects.clear();
+        const float sx = width / cols, sy = height / rows;
+        for (unsigned r = 0; r < rows; r++) {
+            for (unsigned c = 0; c < cols; c++) {
+                if (!solid[r * cols + c]) continue;
+                unsigned end = c;
+                while (end < cols && solid[r * cols + end]) end++;
+                rects.push_back({ c * sx, r * sy, (end - c) * sx, sy });
+                c = end;
+            }
+        }
+        return true;
+    }
+
+    bool empty() const { return solid.empty(); }
+
+    /** @return true if pos is on a solid pixel */
+    bool at(const vec2f& pos) const
+    {
+        if (pos.x < 0 || pos.y < 0 || pos.x >= width || pos.y >= height) return false;
+        const unsigned c = std::min<unsigned>(pos.x * cols / width, cols - 1);
+        const unsigned r = std::min<unsigned>(pos.y * rows / height, rows - 1);
+        return solid[r * cols + c];
+    }
+};
+
+/**
+ * The rectangles a population steers around.
+ * The obstacles go into a bounding volume hierarchy that is only rebuilt when
+ * they change. Queries return the same obstacle a scan over every obstacle in
+ * order would, so the tree never changes the simulation.
+ * With an obstacle map, the map and the static obstacles are baked into a
+ * distance field instead, and a query costs one lookup however detailed the
+ * map is. The field only knows the nearest surface, so an obstacle behind
+ * the agent hides one ahead of it that is farther away.
+ */
+struct obstacle_world {
+    static const unsigned leaf_size = 4;
+    static constexpr float field_cell = 8; // pixels between distance field samples
+
+    struct node {
+        SDL_FRect bounds;
+        unsigned first, count; // leaf obstacles in order[first, first + count)
+        unsigned left, right;  // children, when count is 0
+    };
+
+    std::vector<SDL_FRect> statics;
+    std::vector<node> nodes;      // nodes[0] is the root
+    std::vector<unsigned> order;  // indices into statics, grouped by leaf
+    const obstacle_map* map = nullptr;
+    distance_field field;         // of the map and the statics, when there is a map
+
+    /**
+     * replace the static obstacles and the map, which may be null or empty, rebuilding the tree
+     * and the distance field only if they differ from the current ones. the map must outlive the world
+     */
+    void set_static(const std::vector<SDL_FRect>& rects, const obstacle_map* map = nullptr)
+    {
+        if (map && map->empty()) map = nullptr;
+        auto same = [](const SDL_FRect& a, const SDL_FRect& b) { return a.x == b.x && a.y == b.y && a.w == b.w && a.h == b.h; };
+        if (map == this->map && rects.size() == statics.size() && std::equal(rects.begin(), rects.end(), statics.begin(), same)) return;
+
+        statics = rects;
+        this->map = map;
+        order.resize(statics.size());
+        for (unsigned i = 0; i < order.size(); i++) order[i] = i;
+        nodes.clear();
+        if (!statics.empty()) build(0, statics.size());
+
+        field.clear();
+        if (map) {
+            const unsigned cols = std::ceil(map->width / field_cell), rows = std::ceil(map->height / field_cell);
+            field.build(cols, rows, field_cell, [&](unsigned c, unsigned r) {
+                const vec2f center{ (c + .5f) * field_cell, (r + .5f) * field_cell };
+                if (map->at(center)) return true;
+                for (const SDL_FRect& rect : statics) if (mag(vec_to(center, rect)) == 0) return true;
+                return false;
+            });
+        }
+    }
+
+    /**
+     * @return the shortest vector from pos to the closest obstacle within radius that accept(vec) is true for,
+     * or {INFINITY, INFINITY} if there is none. ties go to the obstacle that comes first
+     */
+    template <typename Pred>
+    vec2f closest(const vec2f& pos, float radius, Pred accept) const
+    {
+        vec2f best{ INFINITY, INFINITY };
+        unsigned best_index = -1;
+        auto consider = [&](const vec2f& ob, unsigned index) {
+            if (mag(ob) > radius) return;
+            if (!accept(ob)) return;
+            if (mag(ob) < mag(best) || (mag(ob) == mag(best) && index < best_index)) {
+                best = ob;
+                best_index = index;
+            }
+        };
+
+        if (!field.empty()) consider(field.to_surface(pos), 0);
+        else if (!nodes.empty()) search(0, pos, radius, best, consider);
+        return best;
+    }
+
+    /** call f(rect) for every obstacle */
+    template <typename F>
+    void for_each(F f) const
+    {
+        for (const SDL_FRect& rect : statics) f(rect);
+    }
+
+    /** build the subtree over order[first, last), @return its node */
+    unsigned build(unsigned first, unsigned last)
+    {
+        const unsigned index = nodes.size();
+        nodes.push_back({});
+
+        float x0 = INFINITY, y0 = INFINITY, x1 = -INFINITY, y1 = -INFINITY;
+        for (unsigned k = first; k < last; k++) {
+            const SDL_FRect& r = statics[order[k]];
+            x0 = std::min(x0, r.x); x1 = std::max(x1, r.x + r.w);
+            y0 = std::min(y0, r.y); y1 = std::max(y1, r.y + r.h);
+        }
+        const SDL_FRect bounds{ x0, y0, x1 - x0, y1 - y0 };
+
+        if (last - first <= leaf_size) {
+            nodes[index] = { bounds, first, last - first, 0, 0 };
+            return index;
+        }
+
+        // split at the median center along the longer side
+        const bool by_y = bounds.h > bounds.w;
+        auto center = [&](unsigned i) { const SDL_FRect& r = statics[i]; return by_y ? r.y + r.h / 2 : r.x + r.w / 2; };
+        const unsigned mid = first + (last - first) / 2;
+        std::nth_element(order.begin() + first, order.begin() + mid, order.begin() + last, [&](unsigned a, unsigned b) {
+            return center(a) < center(b) || (center(a) == center(b) && a < b);
+        });
+
+        const unsigned left = build(first, mid);
+        const unsigned right = build(mid, last);
+        nodes[index] = { bounds, 0, 0, left, right };
+        return index;
+    }
+
+    template <typename F>
+    void search(unsigned index, const vec2f& pos, float radius, const vec2f& best, F& consider) const
+    {
+        const node& n = nodes[index];
+        const float reach = mag(vec_to(pos, n.bounds)); // no obstacle inside is closer than its bounds
+        if (reach > radius || reach > mag(best)) return;
+
+        if (n.count) {
+            for (unsigned k = n.first; k < n.first + n.count; k++) consider(vec_to(pos, statics[order[k]]), order[k]);
+        } else {
+            search(n.left, pos, radius, best, consider);
+            search(n.right, pos, radius, best, consider);
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,168 @@
+#ifndef POOL_HH
+#define POOL_HH
+
+#include <vector>
+#include <algorithm>
+#include <cstddef>
+#include <SDL2/SDL.h>
+
+/**
+ * Persistent worker threads for splitting loops into chunks.
+ * Built on SDL threads rather than std::thread, since the win32 threading
+ * model of our mingw toolchain doesn't provide std::thread. The calling thread
+ * works on chunks too, so a pool of one thread runs everything inline.
+ * Loops can be started from several threads at once, and from inside the
+ * chunks of other loops: every thread that has nothing to do, or waits for
+ * its own loop to finish, takes chunks from whichever loop still has some.
+ */
+struct thread_pool {
+    /** a loop over count items, handed out chunk items at a time */
+    struct job {
+        void (*run)(void* data, std::size_t begin, std::size_t end) = nullptr;
+        void* data = nullptr;
+        std::size_t count = 0, chunk = 1;
+        void (*finish)(void* data) = nullptr; // if set, called by the thread that finishes the last item
+        std::size_t next = 0; // first item not handed out yet, guarded by mutex
+        SDL_atomic_t left;    // items not finished yet
+    };
+
+    std::vector<SDL_Thread*> workers;
+    SDL_mutex* mutex = nullptr;
+    SDL_cond* wake = nullptr; // broadcast when a job is queued or finished
+    std::vector<job*> queue;  // jobs with items left to hand out, oldest first, guarded by mutex
+    bool quit = false;
+
+    /** @return the number of threads working on each job, including the caller */
+    unsigned size() const { return workers.size() + 1; }
+
+    /** (re)start the pool with thread_count threads in total */
+    void start(unsigned thread_count)
+    {
+        stop();
+        #if __EMSCRIPTEN__
+        thread_count = 1; // the web build has no threads
+        #endif
+        if (thread_count <= 1) return;
+
+        mutex = SDL_CreateMutex();
+        wake = SDL_CreateCond();
+        quit = false;
+        for (unsigned i = 1; i < thread_count; i++) {
+            SDL_Thread* thread = SDL_CreateThread(worker_main, "boids worker", this);
+            if (thread == nullptr) break; // run with however many we got
+            workers.push_back(thread);
+        }
+    }
+
+    void stop()
+    {
+        if (mutex != nullptr) {
+            SDL_LockMutex(mutex);
+            quit = true;
+            SDL_CondBroadcast(wake);
+            SDL_UnlockMutex(mutex);
+        }
+        for (SDL_Thread* thread : workers) SDL_WaitThread(thread, nullptr);
+        workers.clear();
+        SDL_DestroyCond(wake); wake = nullptr;
+        SDL_DestroyMutex(mutex); mutex = nullptr;
+    }
+
+    ~thread_pool() { stop(); }
+
+    /**
+     * Call f(begin, end) over chunks covering [0, count), spread across the pool.
+     * returns once every chunk is done. Chunks are handed out in no particular
+     * order, so f must not depend on the order they run in. Chunks hold at least
+     * min_chunk items, lower it for loops over a few big items.
+     */
+    template <typename F>
+    void parallel_for(std::size_t count, F f, std::size_t min_chunk = 16)
+    {
+        if (workers.empty() || count < 2) {
+            if (count) f(0, count);
+            return;
+        }
+
+        job j;
+        j.run = [](void* data, std::size_t begin, std::size_t end) { (*static_cast<F*>(data))(begin, end); };
+        j.data = &f;
+        j.count = count;
+        j.chunk = std::max<std::size_t>(min_chunk, count / (size() * 8)); // several chunks per thread to even out the load
+        submit(j);
+        wait(j.left, &j);
+    }
+
+    /** queue j for any thread to work on. j must stay alive until its last item is finished */
+    void submit(job& j)
+    {
+        j.next = 0;
+        SDL_AtomicSet(&j.left, static_cast<int>(j.count));
+        SDL_LockMutex(mutex);
+        queue.push_back(&j);
+        SDL_CondBroadcast(wake);
+        SDL_UnlockMutex(mutex);
+    }
+
+    /**
+     * work on queued jobs, own first if given, until counter drops to zero. whoever
+     * brings it there must call notify(), which finishing a job does
+     */
+    void wait(SDL_atomic_t& counter, job* own = nullptr)
+    {
+        while (SDL_AtomicGet(&counter)) {
+            if (work(own)) continue;
+            SDL_LockMutex(mutex);
+            while (SDL_AtomicGet(&counter) && queue.empty()) SDL_CondWait(wake, mutex);
+            SDL_UnlockMutex(mutex);
+        }
+    }
+
+    void notify()
+    {
+        SDL_LockMutex(mutex);
+        SDL_CondBroadcast(wake);
+        SDL_UnlockMutex(mutex);
+    }
+
+    /** run one chunk of a queued job, of own if it has any left. @return false if no job had any */
+    bool work(job* own = nullptr)
+    {
+        SDL_LockMutex(mutex);
+        job* j = own && own->next < own->count ? own : queue.empty() ? nullptr : queue.front();
+        if (j == nullptr) {
+            SDL_UnlockMutex(mutex);
+            return false;
+        }
+        const std::size_t begin = j->next, end = std::min(begin + j->chunk, j->count);
+        j->next = end;
+        if (end == j->count) queue.erase(std::find(queue.begin(), queue.end(), j));
+        SDL_UnlockMutex(mutex);
+
+        // the job may be gone as soon as its last item is counted
+        void (*finish)(void*) = j->finish;
+        void* data = j->data;
+        j->run(data, begin, end);
+        const int items = static_cast<int>(end - begin);
+        if (SDL_AtomicAdd(&j->left, -items) == items) {
+            if (finish) finish(data);
+            notify();
+        }
+        return true;
+    }
+
+    static int worker_main(void* data)
+    {
+        thread_pool& pool = *static_cast<thread_pool*>(data);
+        for (;;) {
+            if (pool.work()) continue;
+            SDL_LockMutex(pool.mutex);
+            while (pool.queue.empty() && !pool.quit) SDL_CondWait(pool.wake, pool.mutex);
+            const bool quit = pool.quit;
+            SDL_UnlockMutex(pool.mutex);
+            if (quit) return 0;
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,79 @@
+#ifndef PROFILE_HH
+#define PROFILE_HH
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <SDL2/SDL.h>
+
+/**
+ * Rolling timings of one phase of a frame, over its last profile_window calls.
+ * Only touch a phase from one thread, the one that times it.
+ */
+struct profile_phase {
+    static constexpr unsigned profile_window = 256;
+
+    const char* name;
+    float samples[profile_window]; // milliseconds, a ring buffer
+    unsigned filled = 0;
+    unsigned next = 0;
+    uint64_t calls = 0; // since startup
+
+    profile_phase(const char* name) : name(name) {}
+
+    void add(float ms)
+    {
+        samples[next] = ms;
+        next = (next + 1) % profile_window;
+        filled = std::min(filled + 1, profile_window);
+        calls++;
+    }
+
+    float min() const { return filled ? *std::min_element(samples, samples + filled) : 0; }
+
+    float avg() const
+    {
+        float sum = 0;
+        for (unsigned i = 0; i < filled; i++) sum += samples[i];
+        return filled ? sum / filled : 0;
+    }
+
+    /** @return the time 99% of the calls in the window stayed under */
+    float p99() const
+    {
+        if (!filled) return 0;
+        float sorted[profile_window];
+        std::copy(samples, samples + filled, sorted);
+        unsigned k = (filled * 99) / 100;
+        std::nth_element(sorted, sorted + k, sorted + filled);
+        return sorted[k];
+    }
+};
+
+/** adds the time from construction to destruction to a phase */
+struct scoped_timer {
+    profile_phase& phase;
+    uint64_t start;
+
+    scoped_timer(profile_phase& phase) : phase(phase), start(SDL_GetPerformanceCounter()) {}
+    ~scoped_timer() { phase.add((SDL_GetPerformanceCounter() - start) * 1000.f / SDL_GetPerformanceFrequency()); }
+};
+
+/** @return one line per phase that ran, with its call count and rolling min/avg/p99 in milliseconds */
+std::string profile_report(const profile_phase* phases, unsigned count)
+{
+    // the header goes through the same widths as the rows, so the columns line up
+    char line[128];
+    snprintf(line, sizeof(line), "%-16s %10s %9s %9s %9s\n", "PHASE", "CALLS", "MIN ms", "AVG ms", "P99 ms");
+    std::string report = line;
+    for (unsigned i = 0; i < count; i++) {
+        const profile_phase& p = phases[i];
+        if (!p.calls) continue;
+        snprintf(line, sizeof(line), "%-16s %10llu %9.3f %9.3f %9.3f\n", p.name, (unsigned long long)p.calls, p.min(), p.avg(), p.p99());
+        report += line;
+    }
+    return report;
+}
+
+#endif
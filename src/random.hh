@@ -0,0 +1,38 @@
+#ifndef RANDOM_HH
+#define RANDOM_HH
+
+#include <cstdint>
+
+/** splitmix64 finalizer, every input bit affects every output bit */
+constexpr uint64_t splitmix64(uint64_t x)
+{
+    x += 0x9e3779b97f4a7c15ull;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+/**
+ * Counter based random bits: a pure function of (seed, tick, agent, draw).
+ * Nothing is carried from one draw to the next, so agents can draw in any
+ * order on any thread and a run still reproduces exactly from its seed.
+ * Use a different draw id for every independent number an agent needs in a tick.
+ */
+constexpr uint64_t random_bits(uint64_t seed, uint64_t tick, uint64_t agent, uint64_t draw)
+{
+    return splitmix64(splitmix64(splitmix64(splitmix64(seed) ^ tick) ^ agent) ^ draw);
+}
+
+/** @return a uniformly distributed float in [0, 1) */
+constexpr float random_percent(uint64_t seed, uint64_t tick, uint64_t agent, uint64_t draw)
+{
+    return (random_bits(seed, tick, agent, draw) >> 40) * (1.f / (1 << 24));
+}
+
+/** @return a uniformly distributed float in [min, max) */
+constexpr float random_range(float min, float max, uint64_t seed, uint64_t tick, uint64_t agent, uint64_t draw)
+{
+    return min + (max - min) * random_percent(seed, tick, agent, draw);
+}
+
+#endif
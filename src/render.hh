@@ -2,7 +2,8 @@
 #define RENDER_HH
 
 #include <string>
-#include <SDL2\SDL.h>
+#include <vector>
+#include <SDL2/SDL.h>
 
 #include "resource.hh"
 #include "vec2.hh"
@@ -72,4 +73,62 @@ void RenderCircle(SDL_Renderer* renderer, float radius, const vec2f& pos)
     SDL_RenderDrawLinesF(renderer, circle, count + 1);
 }
 
+/**
+ * Colored line segments collected over a frame and drawn together.
+ * With SDL 2.0.18 or newer every segment becomes a one pixel wide quad and the
+ * whole batch is submitted in a single SDL_RenderGeometry call. Older SDL has no
+ * geometry api, so the segments are drawn one by one, only changing the draw color
+ * when it differs from the previous segment's.
+ */
+struct line_batch {
+    struct segment {
+        vec2f p1, p2;
+        SDL_Color c1, c2;
+    };
+    std::vector<segment> segments;
+    #if SDL_VERSION_ATLEAST(2, 0, 18)
+    std::vector<SDL_Vertex> vertices; // kept between frames so drawing doesn't allocate
+    std::vector<int> indices;
+    #endif
+
+    void clear() { segments.clear(); }
+
+    void add(const vec2f& p1, const vec2f& p2, SDL_Color color) { segments.push_back({ p1, p2, color, color }); }
+    /** the color fades from c1 at p1 to c2 at p2, without geometry support the line takes c1 */
+    void add(const vec2f& p1, SDL_Color c1, const vec2f& p2, SDL_Color c2) { segments.push_back({ p1, p2, c1, c2 }); }
+
+    /** draw and clear every segment */
+    void draw(SDL_Renderer* renderer)
+    {
+        #if SDL_VERSION_ATLEAST(2, 0, 18)
+        vertices.clear();
+        indices.clear();
+        for (const segment& s : segments) {
+            const vec2f side = normal(vec2f{ s.p1.y - s.p2.y, s.p2.x - s.p1.x }, { 0.5f, 0 }) * 0.5f; // half a pixel either side of the line
+            const int base = vertices.size();
+            vertices.push_back({ { s.p1.x + side.x, s.p1.y + side.y }, s.c1, { 0, 0 } });
+            vertices.push_back({ { s.p1.x - side.x, s.p1.y - side.y }, s.c1, { 0, 0 } });
+            vertices.push_back({ { s.p2.x + side.x, s.p2.y + side.y }, s.c2, { 0, 0 } });
+            vertices.push_back({ { s.p2.x - side.x, s.p2.y - side.y }, s.c2, { 0, 0 } });
+            for (int i : { 0, 1, 2, 1, 3, 2 }) indices.push_back(base + i);
+        }
+        if (!vertices.empty()) {
+            SDL_RenderGeometry(renderer, nullptr, vertices.data(), vertices.size(), indices.data(), indices.size());
+        }
+        #else
+        SDL_Color color{ 0, 0, 0, 0 };
+        for (std::size_t i = 0; i < segments.size(); i++) {
+            const segment& s = segments[i];
+            const SDL_Color& c = s.c1;
+            if (i == 0 || c.r != color.r || c.g != color.g || c.b != color.b || c.a != color.a) {
+                SDL_SetRenderDrawColor(renderer, c.r, c.g, c.b, c.a);
+                color = c;
+            }
+            SDL_RenderDrawLineF(renderer, s.p1.x, s.p1.y, s.p2.x, s.p2.y);
+        }
+        #endif
+        clear();
+    }
+};
+
 #endif
\ No newline at end of file
@@ -3,7 +3,7 @@
 
 #include <iostream>
 #include <vector>
-#include <SDL2\SDL.h>
+#include <SDL2/SDL.h>
 #include "cleanup.hh"
 
 // Apparently the c++17 filesystem library is broken on the current version of
@@ -53,6 +53,16 @@ const std::string getResource(const std::string &resource)
     return resPath + resource;
 }
 
+/**
+ * \brief Loads a BMP image from the resource folder into memory
+ * \param file The image file to load
+ * \return the loaded surface, or nullptr if something went wrong
+ */
+SDL_Surface *loadSurface(const std::string &file)
+{
+    return SDL_LoadBMP(getResource(file).c_str());
+}
+
 /**
  * \brief Loads an image into a texture on the rendering device
  * \param render The renderer to load the texture onto
@@ -62,7 +72,7 @@ const std::string getResource(const std::string &resource)
 SDL_Texture *loadTexture(SDL_Renderer *render, const std::string &file)
 {
     SDL_Texture *texture = nullptr;
-    SDL_Surface *surface = SDL_LoadBMP(getResource(file).c_str());
+    SDL_Surface *surface = loadSurface(file);
     if (surface == nullptr)
         return nullptr;
     texture = SDL_CreateTextureFromSurface(render, surface);
@@ -81,7 +91,7 @@ SDL_Texture *loadTexture(SDL_Renderer *render, const std::string &file)
 SDL_Texture *loadTextureTransparent(SDL_Renderer *render, const std::string &file)
 {
     SDL_Texture *texture = nullptr;
-    SDL_Surface *surface = SDL_LoadBMP(getResource(file).c_str());
+    SDL_Surface *surface = loadSurface(file);
     if (surface == nullptr)
         return nullptr;
     SDL_SetColorKey(surface, SDL_TRUE, SDL_MapRGB(surface->format, 0x00, 0x00, 0xFF));
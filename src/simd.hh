@@ -0,0 +1,169 @@
+#ifndef SIMD_HH
+#define SIMD_HH
+
+#include <vector>
+#include <SDL2/SDL.h>
+
+#include "vec2.hh"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SIMD_X86 1
+#include <immintrin.h>
+#else
+#define SIMD_X86 0
+#endif
+
+// mingw-w64 can't realign the stack for 32 byte values (gcc bug 54412), and its unoptimized
+// build keeps every __m256 local on the stack, so it gets no avx2 kernels
+#if SIMD_X86 && !defined(__MINGW32__)
+#define SIMD_AVX2_KERNELS 1
+#else
+#define SIMD_AVX2_KERNELS 0
+#endif
+
+/*
+ * Vectorized neighbor search over a run of candidates stored contiguously in
+ * grid order. The squared distances are computed with the same float operations
+ * as the scalar loop (no fma), so every kernel finds exactly the same neighbors,
+ * in the same order, with bit identical distances.
+ */
+
+enum simd_level {
+    SIMD_NONE,
+    SIMD_SSE2,
+    SIMD_AVX2,
+};
+
+/** @return the widest kernel this cpu can run */
+simd_level detect_simd()
+{
+    #if SIMD_X86
+    if (SIMD_AVX2_KERNELS && SDL_HasAVX2()) return SIMD_AVX2;
+    if (SDL_HasSSE2()) return SIMD_SSE2;
+    #endif
+    return SIMD_NONE;
+}
+
+simd_level simd_support = detect_simd();
+
+/** the agent whose neighbors are searched for */
+struct search_query {
+    vec2f pos;
+    unsigned index; // skipped when it turns up among the candidates
+    float radius2;
+};
+
+/** candidate fields, stored contiguously in grid order */
+struct search_data {
+    const float *x, *y;
+    const unsigned *index;
+};
+
+/** append every k in [begin, end) within the radius to found, and its squared distance to dist2 */
+void search_scalar(const search_query& q, const search_data& d, unsigned begin, unsigned end, std::vector<unsigned>& found, std::vector<float>& dist2)
+{
+    for (unsigned k = begin; k < end; k++)
+    {
+        if (d.index[k] == q.index) continue;
+        const float d2 = dist_squared(q.pos, { d.x[k], d.y[k] });
+        if (d2 <= q.radius2) {
+            found.push_back(k);
+            dist2.push_back(d2);
+        }
+    }
+}
+
+#if SIMD_X86
+
+void search_sse2(const search_query& q, const search_data& d, unsigned begin, unsigned end, std::vector<unsigned>& found, std::vector<float>& dist2)
+{
+    const __m128 px = _mm_set1_ps(q.pos.x), py = _mm_set1_ps(q.pos.y), r2 = _mm_set1_ps(q.radius2);
+    const __m128i self = _mm_set1_epi32(q.index);
+
+    unsigned k = begin;
+    for (; k + 4 <= end; k += 4)
+    {
+        const __m128 ox = _mm_sub_ps(_mm_loadu_ps(d.x + k), px), oy = _mm_sub_ps(_mm_loadu_ps(d.y + k), py);
+        const __m128 d2 = _mm_add_ps(_mm_mul_ps(ox, ox), _mm_mul_ps(oy, oy));
+        const __m128i gi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(d.index + k));
+        int bits = _mm_movemask_ps(_mm_cmple_ps(d2, r2)) & ~_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(gi, self)));
+        if (!bits) continue;
+
+        float lanes[4];
+        _mm_storeu_ps(lanes, d2);
+        while (bits) {
+            const int lane = __builtin_ctz(bits);
+            found.push_back(k + lane);
+            dist2.push_back(lanes[lane]);
+            bits &= bits - 1;
+        }
+    }
+
+    search_scalar(q, d, k, end, found, dist2);
+}
+
+#if SIMD_AVX2_KERNELS
+
+/*
+ * NOTE: mingw-w64 does not realign the stack for spilled 32 byte values (gcc bug 54412), so nothing
+ * in this kernel may be spilled. found and dist2 get room for every candidate before the loop and
+ * are cut back to the neighbors after it, so the loop makes no calls that vectors would be saved around,
+ * and the distances are written straight to dist2 rather than through an array on the stack
+ */
+__attribute__((target("avx2")))
+void search_avx2(const search_query& q, const search_data& d, unsigned begin, unsigned end, std::vector<unsigned>& found, std::vector<float>& dist2)
+{
+    const std::size_t first = found.size();
+    found.resize(first + (end - begin) / 8 * 8);
+    dist2.resize(found.size());
+    unsigned* out_k = found.data() + first;
+    float* out_d2 = dist2.data() + first;
+
+    const __m256 px = _mm256_set1_ps(q.pos.x), py = _mm256_set1_ps(q.pos.y), r2 = _mm256_set1_ps(q.radius2);
+    const __m256i self = _mm256_set1_epi32(q.index);
+
+    unsigned k = begin;
+    for (; k + 8 <= end; k += 8)
+    {
+        const __m256 ox = _mm256_sub_ps(_mm256_loadu_ps(d.x + k), px), oy = _mm256_sub_ps(_mm256_loadu_ps(d.y + k), py);
+        const __m256 d2 = _mm256_add_ps(_mm256_mul_ps(ox, ox), _mm256_mul_ps(oy, oy));
+        const __m256i gi = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(d.index + k));
+        int bits = _mm256_movemask_ps(_mm256_cmp_ps(d2, r2, _CMP_LE_OQ)) & ~_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(gi, self)));
+        if (!bits) continue;
+
+        // the 8 distances go out as they are, and the neighbors' are moved down over the others
+        _mm256_storeu_ps(out_d2, d2);
+        int n = 0;
+        for (; bits; n++, bits &= bits - 1) {
+            const int lane = __builtin_ctz(bits);
+            out_k[n] = k + lane;
+            out_d2[n] = out_d2[lane];
+        }
+        out_k += n;
+        out_d2 += n;
+    }
+
+    found.resize(out_k - found.data());
+    dist2.resize(found.size());
+    search_scalar(q, d, k, end, found, dist2);
+}
+
+#endif
+
+#endif
+
+/** append the candidates at [begin, end) that are neighbors of q, using the widest kernel selected by simd_support */
+void search_neighbors(const search_query& q, const search_data& d, unsigned begin, unsigned end, std::vector<unsigned>& found, std::vector<float>& dist2)
+{
+    switch (simd_support) {
+        #if SIMD_AVX2_KERNELS
+        case SIMD_AVX2: search_avx2(q, d, begin, end, found, dist2); break;
+        #endif
+        #if SIMD_X86
+        case SIMD_SSE2: search_sse2(q, d, begin, end, found, dist2); break;
+        #endif
+        default: search_scalar(q, d, begin, end, found, dist2); break;
+    }
+}
+
+#endif
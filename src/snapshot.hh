@@ -0,0 +1,88 @@
+#ifndef SNAPSHOT_HH
+#define SNAPSHOT_HH
+
+#include <vector>
+#include <SDL2/SDL.h>
+
+/**
+ * Hands the latest of a stream of values from one writer thread to one reader thread
+ * without either ever waiting on the other. The writer fills its own slot and publishes
+ * it by swapping it with the spare one, the reader swaps its slot for the spare one when
+ * that holds something newer. Values the reader never got to are overwritten, so it
+ * always sees the newest published value, and the slots are reused without copying
+ * or reallocating.
+ */
+template <typename T>
+struct triple_buffer {
+    static const int fresh = 4; // set on the spare slot's index when it was published after the reader last took one
+
+    T slots[3];
+    int back = 0;  // the writer's slot
+    int front = 1; // the reader's slot
+    SDL_atomic_t spare;
+
+    triple_buffer() { SDL_AtomicSet(&spare, 2); }
+
+    /** the slot to fill, owned by the writer until publish() */
+    T& write() { return slots[back]; }
+
+    /** make the filled slot the newest value, and take another one to fill */
+    void publish()
+    {
+        SDL_MemoryBarrierRelease(); // the slot's contents are written before it's handed over
+        back = SDL_AtomicSet(&spare, back | fresh) & ~fresh;
+    }
+
+    /** take the newest value if one was published since the last call, @return true if there was one */
+    bool acquire()
+    {
+        if (!(SDL_AtomicGet(&spare) & fresh)) return false;
+        front = SDL_AtomicSet(&spare, front) & ~fresh;
+        SDL_MemoryBarrierAcquire();
+        return true;
+    }
+
+    /** the value the reader took last, owned by the reader until the next acquire() */
+    const T& read() const { return slots[front]; }
+};
+
+/**
+ * Messages from any thread to one receiving thread, in the order they were sent.
+ * Sending takes a lock only long enough to append, the receiver takes every
+ * pending message at once, so neither waits on the other for more than that
+ */
+template <typename T>
+struct message_queue {
+    SDL_mutex* mutex = SDL_CreateMutex();
+    SDL_cond* sent = SDL_CreateCond();
+    std::vector<T> pending;
+
+    ~message_queue()
+    {
+        SDL_DestroyCond(sent);
+        SDL_DestroyMutex(mutex);
+    }
+
+    void send(const T& message)
+    {
+        SDL_LockMutex(mutex);
+        pending.push_back(message);
+        SDL_CondSignal(sent);
+        SDL_UnlockMutex(mutex);
+    }
+
+    /**
+     * swap the pending messages into received, which is cleared first, waiting up to
+     * timeout milliseconds for one to arrive if none is pending
+     */
+    void receive(std::vector<T>& received, Uint32 timeout = 0)
+    {
+        received.clear();
+        SDL_LockMutex(mutex);
+        if (pending.empty() && timeout) SDL_CondWaitTimeout(sent, mutex, timeout);
+        pending.swap(received);
+        SDL_UnlockMutex(mutex);
+    }
+};
+
+#endif
@@ -0,0 +1,92 @@
+#ifndef SORT_HH
+#define SORT_HH
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+
+#include "util.hh"
+#include "pool.hh"
+
+/** @return v with a zero bit inserted above each of its low 16 bits */
+constexpr uint32_t spread_bits(uint32_t v)
+{
+    v &= 0xffff;
+    v = (v | (v << 8)) & 0x00ff00ff;
+    v = (v | (v << 4)) & 0x0f0f0f0f;
+    v = (v | (v << 2)) & 0x33333333;
+    v = (v | (v << 1)) & 0x55555555;
+    return v;
+}
+
+/**
+ * @return the Z-order (Morton) key of a position inside a width by height area.
+ * Positions that are close together mostly get keys that are close together.
+ * Positions outside the area are clamped to its edge
+ */
+uint32_t morton_key(float x, float y, float width, float height)
+{
+    uint32_t qx = static_cast<uint32_t>(clamp(x / width, 0.f, 1.f) * 65535);
+    uint32_t qy = static_cast<uint32_t>(clamp(y / height, 0.f, 1.f) * 65535);
+    return spread_bits(qx) | (spread_bits(qy) << 1);
+}
+
+/**
+ * Stable least significant digit radix sort of (key, value) pairs, 8 bits at a time.
+ * Each pass counts the digits of every block in parallel, then scatters the blocks
+ * in parallel to offsets that keep equal keys in their original order. Scratch
+ * space is kept between sorts.
+ */
+struct radix_sorter {
+    static const std::size_t block_size = 4096;
+
+    std::vector<uint32_t> key_scratch;
+    std::vector<unsigned> value_scratch;
+    std::vector<unsigned> counts; // 256 per block, turned into offsets
+
+    void sort(thread_pool& pool, std::vector<uint32_t>& keys, std::vector<unsigned>& values)
+    {
+        const std::size_t count = keys.size();
+        const std::size_t blocks = (count + block_size - 1) / block_size;
+        key_scratch.resize(count);
+        value_scratch.resize(count);
+        counts.resize(blocks * 256);
+
+        for (unsigned shift = 0; shift < 32; shift += 8) {
+            std::fill(counts.begin(), counts.end(), 0);
+            pool.parallel_for(blocks, [&](std::size_t begin, std::size_t end) {
+                for (std::size_t b = begin; b < end; b++) {
+                    unsigned* c = &counts[b * 256];
+                    for (std::size_t i = b * block_size; i < std::min(count, (b + 1) * block_size); i++) c[(keys[i] >> shift) & 0xff]++;
+                }
+            }, 1);
+
+            // digit major, then block, so each block scatters after the blocks before it
+            unsigned offset = 0;
+            for (unsigned digit = 0; digit < 256; digit++) {
+                for (std::size_t b = 0; b < blocks; b++) {
+                    unsigned n = counts[b * 256 + digit];
+                    counts[b * 256 + digit] = offset;
+                    offset += n;
+                }
+            }
+
+            pool.parallel_for(blocks, [&](std::size_t begin, std::size_t end) {
+                for (std::size_t b = begin; b < end; b++) {
+                    unsigned* c = &counts[b * 256];
+                    for (std::size_t i = b * block_size; i < std::min(count, (b + 1) * block_size); i++) {
+                        unsigned to = c[(keys[i] >> shift) & 0xff]++;
+                        key_scratch[to] = keys[i];
+                        value_scratch[to] = values[i];
+                    }
+                }
+            }, 1);
+
+            keys.swap(key_scratch);
+            values.swap(value_scratch);
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,89 @@
+#ifndef TASKS_HH
+#define TASKS_HH
+
+#include <vector>
+#include <functional>
+#include <initializer_list>
+#include <SDL2/SDL.h>
+
+#include "pool.hh"
+#include "profile.hh"
+
+/**
+ * Tasks and the tasks each one has to wait for, run together on a thread pool.
+ * A task is queued as soon as the last task it waits for is done, so tasks that
+ * don't wait for each other overlap, and the loops inside them spread over
+ * whichever threads are free. The graph is built once and run any number of times.
+ */
+struct task_graph {
+    struct task {
+        std::function<void()> run;
+        profile_phase* phase = nullptr; // times every run of the task, if set
+        std::vector<unsigned> next;     // tasks that wait for this one
+        unsigned waits = 0;             // number of tasks this one waits for
+        SDL_atomic_t waiting;           // of those, the ones not done yet in this run
+        thread_pool::job job;
+        task_graph* graph = nullptr;
+    };
+
+    std::vector<task> tasks;
+    thread_pool* pool = nullptr;
+    SDL_atomic_t left; // tasks not done yet in this run
+
+    /** add a task that runs after every task in after, which must have been added already. @return its id */
+    unsigned add(std::function<void()> run, profile_phase* phase = nullptr, std::initializer_list<unsigned> after = {})
+    {
+        const unsigned id = tasks.size();
+        tasks.emplace_back();
+        tasks[id].run = std::move(run);
+        tasks[id].phase = phase;
+        tasks[id].waits = after.size();
+        for (unsigned t : after) tasks[t].next.push_back(id);
+        return id;
+    }
+
+    /** run every task once, returns when all are done */
+    void run(thread_pool& pool)
+    {
+        if (pool.size() == 1) {
+            for (task& t : tasks) execute(t); // tasks only wait for ones added before them
+            return;
+        }
+
+        this->pool = &pool;
+        SDL_AtomicSet(&left, static_cast<int>(tasks.size()));
+        for (task& t : tasks) {
+            t.graph = this;
+            SDL_AtomicSet(&t.waiting, static_cast<int>(t.waits));
+            t.job.run = [](void* data, std::size_t, std::size_t) { execute(*static_cast<task*>(data)); };
+            t.job.data = &t;
+            t.job.count = 1;
+            t.job.finish = done;
+        }
+        for (task& t : tasks) if (!t.waits) pool.submit(t.job);
+        pool.wait(left);
+    }
+
+    static void execute(task& t)
+    {
+        if (t.phase == nullptr) {
+            t.run();
+            return;
+        }
+        scoped_timer timer(*t.phase);
+        t.run();
+    }
+
+    /** queue the tasks that were only waiting for t */
+    static void done(void* data)
+    {
+        task& t = *static_cast<task*>(data);
+        task_graph& graph = *t.graph;
+        for (unsigned n : t.next) {
+            if (SDL_AtomicAdd(&graph.tasks[n].waiting, -1) == 1) graph.pool->submit(graph.tasks[n].job);
+        }
+        SDL_AtomicAdd(&graph.left, -1);
+    }
+};
+
+#endif
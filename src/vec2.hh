@@ -1,7 +1,7 @@
 #ifndef VEC2_HH
 #define VEC2_HH
 
-#include <SDL2\SDL.h>
+#include <SDL2/SDL.h>
 #include <cmath>
 #include <ostream>
 
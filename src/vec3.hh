@@ -1,7 +1,7 @@
 #ifndef VEC3_HH
 #define VEC3_HH
 
-#include <SDL2\SDL.h>
+#include <SDL2/SDL.h>
 #include <cmath>
 #include <ostream>
 